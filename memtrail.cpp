@@ -28,17 +28,21 @@
 #define _GNU_SOURCE
 #endif
 
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <limits.h>
+#include <stdint.h>
+#include <time.h>
 
 #include <malloc.h>
 #include <errno.h>
 #include <dlfcn.h>
 #include <pthread.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <linux/limits.h> // PIPE_BUF
@@ -62,8 +66,22 @@
 #define RECORD 1
 
 #define MAX_STACK 32
-#define MAX_MODULES 128
+#define MAX_MODULES 127 // module numbers must leave MODULE_DEFINITION clear
 #define MAX_SYMBOLS 131071
+#define MAX_TAGS 4096
+#define MAX_TAG_DEPTH 64
+#define MAX_TAG_NAME 256
+#define MAX_MMAP_WINDOWS 4096
+#define MMAP_WINDOW_SIZE (16*1024*1024)
+#define MAX_THREADS 1024
+#define MAX_FILTER_RULES 32
+#define MAX_FILTER_PATTERN 256
+#define MAX_SCAN_THREADS 64
+#define SCAN_BATCH 256
+#define RESIDENCY_BATCH 128
+#define RESIDENCY_WINDOW 4096 // pages per mincore call
+#define RESIDENCY_PEAK_GROWTH 8 // resample the peak once it grew by 1/8
+#define SIDE_TABLE_SHARD_BITS 6
 
 
 /* Minimum alignment for this platform */
@@ -75,6 +93,7 @@
 
 
 extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_memalign(size_t alignment, size_t size);
 extern "C" void __libc_free(void *ptr);
 
 
@@ -99,6 +118,47 @@ _assert_fail(const char *expr,
 #endif
 
 
+/**
+ * Whether call stacks are recorded, or just the allocation tags.
+ */
+static bool record_stacks = true;
+
+
+/**
+ * Whether live blocks are scanned for reachability at exit.
+ */
+static bool scan_enabled = false;
+
+
+/**
+ * Whether tracing is stopped, through memtrail_stop() or
+ * MEMTRAIL_START_PAUSED, in which case allocations are neither unwound nor
+ * logged.
+ */
+static bool paused = false;
+
+static inline bool
+_paused(void)
+{
+   return __atomic_load_n(&paused, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * Capture the caller's context, if its call stack is going to be recorded.
+ *
+ * This must be a macro, as unw_getcontext() captures the registers of the
+ * function it is invoked from.
+ */
+#define GETCONTEXT(uc) \
+   unw_context_t uc##_storage; \
+   unw_context_t *uc = nullptr; \
+   if (record_stacks && !_paused()) { \
+      unw_getcontext(&uc##_storage); \
+      uc = &uc##_storage; \
+   }
+
+
 /**
  * Unlike glibc backtrace, libunwind will not invoke malloc.
  */
@@ -245,9 +305,36 @@ _dladdr (const void *address, Dl_info *info) {
 }
 
 
+struct CounterSlot;
+
 struct header_t {
+   // Blocks allocated without a call stack (e.g., when only recording tags)
+   // don't carry this
+   void *addrs[MAX_STACK];
+
    struct list_head list_head;
 
+   // Slot whose list holds the block's last event until it's flushed, if any
+   struct CounterSlot *pending;
+
+   // Entry in the list of live blocks, when these are being scanned
+   struct list_head live_head;
+
+   unsigned char addr_count;
+
+   // Allocation tag, or zero
+   unsigned short tag;
+
+   // Number of reallocs that led to this block, the bytes they copied, and
+   // the size of the block the chain started from
+   unsigned realloc_steps;
+   size_t realloc_copied;
+   size_t realloc_origin;
+
+   // Blocks that are never logged (allocated while tracing is stopped, or
+   // excluded by size) may only carry the fields below, so everything above
+   // must not be touched for compact ones.
+
    // Real pointer
    void *ptr;
 
@@ -255,308 +342,2534 @@ struct header_t {
    size_t size;
 
    unsigned allocated:1;
-   unsigned pending:1;
    unsigned internal:1;
 
-   unsigned char addr_count;
-   void *addrs[MAX_STACK];
+   // Object from an application-level allocator, reported through
+   // memtrail_alloc_event().  The header is a separate block, and ptr is the
+   // object's address.
+   unsigned custom:1;
+
+   unsigned live:1;
+
+   // Excluded by the record-time filter
+   unsigned filtered:1;
+
+   // Allocated while tracing was stopped, so never logged nor accounted
+   unsigned untraced:1;
+
+   // Kept in the side table, so the header is a separate block, and ptr is
+   // the block handed out to the application
+   unsigned detached:1;
+
+   // Only the fields from ptr onwards exist
+   unsigned compact:1;
 };
 
+#define COMPACT_HEADER_SIZE (sizeof(struct header_t) - offsetof(struct header_t, ptr))
+#define STACKLESS_HEADER_SIZE (sizeof(struct header_t) - offsetof(struct header_t, list_head))
+
 
 static pthread_mutex_t
 mutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
 
-static ssize_t
-total_size = 0;
-
-static ssize_t
-max_size = 0;
-
 static ssize_t
 limit_size = SSIZE_MAX;
 
-struct list_head
-hdr_list = { &hdr_list, &hdr_list };
-
 static int fd = -1;
 
 
+/*
+ * Special events, logged with a null pointer and a non-positive size.
+ *
+ * In the varint encoding, a zero pointer delta introduces the special event
+ * number, and the remaining fields are varints too.
+ */
+enum
+{
+   EVENT_SNAPSHOT = 0,
+   EVENT_CUSTOM = -1, // next event refers to a custom allocator object
+   EVENT_TAG = -2, // next event's allocation tag
+   EVENT_TAG_NAME = -3, // allocation tag definition
+   EVENT_UNREACHABLE = -4, // blocks found unreachable at exit
+   EVENT_REALLOC = -5, // next event's realloc chain
+   EVENT_REALLOC_CHAIN = -6, // realloc chain freed
+   EVENT_RESIDENCY = -7, // resident bytes of large blocks
+   EVENT_STATS = -8, // memtrail's own overhead, at exit
+};
+
+static size_t pagesize = 4096;
+
 
-struct Module {
-   const char *dli_fname;
-   void       *dli_fbase;
+/*
+ * Header flags.  The first format stored them in the upper bits of the
+ * leading pointer size byte.
+ */
+enum
+{
+   FLAG_CHUNKED = 0x80, // events are framed in length-prefixed chunks
+   FLAG_MODULE_DEFS = 0x40, // module definitions are flagged in frames
+   FLAG_TAGS_ONLY = 0x01, // no call stacks, just allocation tags
+   FLAG_MMAP = 0x02, // recorded through a memory mapped file
+   FLAG_SCAN = 0x04, // unreachable blocks are scanned at exit
+   FLAG_FILTERED = 0x08, // filtered at record time
 };
 
-static Module modules[MAX_MODULES];
-static unsigned numModules = 0;
 
-struct Symbol {
-   void *addr;
-   Module *module;
+/*
+ * Versioned file header.
+ *
+ * Its size is a multiple of four, so that chunks stay aligned.
+ */
+#define FORMAT_MAGIC "MTRL"
+#define FORMAT_VERSION 2
+
+struct file_header_t {
+   char magic[4];
+   uint32_t version;
+   uint32_t pointer_size;
+   uint32_t page_size;
+   uint32_t flags;
+   uint32_t pid;
+   uint64_t time_base; // CLOCK_REALTIME nanoseconds when recording started
 };
 
-static Symbol symbols[MAX_SYMBOLS];
 
+/*
+ * Set in a frame's module number when the module's definition follows, so
+ * that any chunk can be decoded without having seen the previous ones.  In
+ * the varint encoding, it's the lowest bit instead.
+ */
+#define MODULE_DEFINITION 0x80
 
 
-class PipeBuf
-{
-protected:
-   int _fd;
-   char _buf[PIPE_BUF];
-   size_t _written;
+/*
+ * Crash-safe recording.
+ *
+ * Events are always framed as a sequence of 4-byte aligned chunks, each
+ * prefixed by its 32-bit length, so that the trace can be split and decoded
+ * in parallel.
+ *
+ * When MEMTRAIL_MMAP is set, memtrail.data is written uncompressed through a
+ * shared memory mapping of a preallocated file.  The length is stored
+ * last, so it doubles as the chunk's commit marker: should the process die at
+ * any point, the page cache holds every committed chunk, followed by zeros or
+ * by a chunk the parser can tell is incomplete.
+ *
+ * Pending events are not held back in this mode, as a crash would lose them,
+ * so each update commits its events as one chunk, and the preallocated tail is
+ * trimmed at exit.
+ */
 
-public:
-   inline
-   PipeBuf(int fd) :
-      _fd(fd),
-      _written(0)
-   {
-      assert(fd >= 0);
-   }
+static bool use_mmap = false;
 
-   inline void
-   write(const void *buf, size_t nbytes) {
-      if (!RECORD) {
-         return;
-      }
+static char *mmap_windows[MAX_MMAP_WINDOWS];
+static size_t mmap_offset = 0;
+static size_t mmap_file_size = 0;
 
-      if (nbytes) {
-         assert(_written + nbytes <= PIPE_BUF);
-         memcpy(_buf + _written, buf, nbytes);
-         _written += nbytes;
-      }
+
+static char *
+_mmap_window(size_t offset)
+{
+   size_t index = offset / MMAP_WINDOW_SIZE;
+   if (index >= ARRAY_SIZE(mmap_windows)) {
+      return NULL;
    }
 
-   inline void
-   flush(void) {
-      if (!RECORD) {
-         return;
+   if (!mmap_windows[index]) {
+      size_t end = (index + 1) * MMAP_WINDOW_SIZE;
+      if (end > mmap_file_size) {
+         // Extending a file with ftruncate() leaves a hole of zeros, which
+         // reads back as the end of the trace
+         if (ftruncate(fd, end) != 0) {
+            return NULL;
+         }
+         mmap_file_size = end;
       }
 
-      if (_written) {
-         ssize_t ret;
-         ret = ::write(_fd, _buf, _written);
-         assert(ret >= 0);
-         assert((size_t)ret == _written);
-         _written = 0;
+      void *window = mmap(NULL, MMAP_WINDOW_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, index * MMAP_WINDOW_SIZE);
+      if (window == MAP_FAILED) {
+         return NULL;
       }
+      mmap_windows[index] = (char *)window;
    }
 
+   return mmap_windows[index] + offset % MMAP_WINDOW_SIZE;
+}
+
 
-   inline
-   ~PipeBuf(void) {
-      flush();
+static bool
+_mmap_copy(size_t offset, const void *data, size_t nbytes)
+{
+   const char *src = (const char *)data;
+   while (nbytes) {
+      char *dst = _mmap_window(offset);
+      if (!dst) {
+         return false;
+      }
+      size_t n = std::min(nbytes, MMAP_WINDOW_SIZE - offset % MMAP_WINDOW_SIZE);
+      memcpy(dst, src, n);
+      offset += n;
+      src += n;
+      nbytes -= n;
    }
-};
+   return true;
+}
 
 
+/**
+ * Append and commit one chunk.
+ */
 static void
-_lookup(PipeBuf &buf, void *addr) {
-   unsigned key = (size_t)addr % MAX_SYMBOLS;
+_mmap_append(const void *data, size_t nbytes)
+{
+   assert(nbytes && nbytes <= UINT32_MAX);
 
-   Symbol *sym = &symbols[key];
+   size_t start = mmap_offset;
+   uint32_t length = nbytes;
+   assert(start % sizeof length == 0);
 
-   bool newModule = false;
+   if (!_mmap_copy(start + sizeof length, data, nbytes)) {
+      fprintf(stderr, "memtrail: error: could not extend memtrail.data\n");
+      abort();
+   }
 
-   if (sym->addr != addr) {
-      Dl_info info;
-      if (_dladdr(addr, &info)) {
-         Module *module = NULL;
-         for (unsigned i = 0; i < numModules; ++i) {
-            if (strcmp(modules[i].dli_fname, info.dli_fname) == 0) {
-               module = &modules[i];
-               break;
-            }
-         }
-         if (!module && numModules < ARRAY_SIZE(modules)) {
-            module = &modules[numModules++];
-            module->dli_fname = info.dli_fname;
-            module->dli_fbase = info.dli_fbase;
-            newModule = true;
-         }
-         sym->module = module;
-      } else {
-         sym->module = NULL;
-      }
+   // Commit.  The length slot is aligned, so it is never seen half written.
+   uint32_t *marker = (uint32_t *)_mmap_window(start);
+   assert(marker);
+   __atomic_store_n(marker, length, __ATOMIC_RELEASE);
 
-      sym->addr = addr;
+   mmap_offset = (start + sizeof length + nbytes + sizeof length - 1) & ~(sizeof length - 1);
+
+   // Windows we are done with are no longer needed in our address space
+   size_t index = start / MMAP_WINDOW_SIZE;
+   while (index < mmap_offset / MMAP_WINDOW_SIZE) {
+      munmap(mmap_windows[index], MMAP_WINDOW_SIZE);
+      mmap_windows[index] = NULL;
+      ++index;
    }
+}
 
-   size_t offset;
-   const char * name;
-   unsigned char moduleNo;
 
-   if (sym->module) {
-      name = sym->module->dli_fname;
-      offset = ((size_t)addr - (size_t)sym->module->dli_fbase);
-      moduleNo = 1 + sym->module - modules;
-   } else {
-      name = "";
-      offset = (size_t)addr;
-      moduleNo = 0;
+/**
+ * Unmap the file, trimming the zeros past the last chunk.  Further chunks map
+ * and extend it again.
+ */
+static void
+_mmap_trim(void)
+{
+   for (unsigned i = 0; i < ARRAY_SIZE(mmap_windows); ++i) {
+      if (mmap_windows[i]) {
+         munmap(mmap_windows[i], MMAP_WINDOW_SIZE);
+         mmap_windows[i] = NULL;
+      }
    }
 
-   buf.write(&addr, sizeof addr);
-   buf.write(&offset, sizeof offset);
-   buf.write(&moduleNo, sizeof moduleNo);
-   if (newModule) {
-      size_t len = strlen(name);
-      buf.write(&len, sizeof len);
-      buf.write(name, len);
+   if (ftruncate(fd, mmap_offset) != 0) {
+      fprintf(stderr, "memtrail: warning: could not truncate segment\n");
    }
+   mmap_file_size = mmap_offset;
 }
 
 
-enum
+static void
+_mmap_close(void)
 {
-   READ_FD  = 0,
-   WRITE_FD = 1
-};
-
+   _mmap_trim();
 
-/**
- * Open a compressed stream for writing by forking a gzip process.
- */
-static int
-_gzopen(const char *name, int oflag, mode_t mode)
-{
-   int       parentToChild[2];
-   pid_t     pid;
-   int out;
-   int ret;
+   mmap_offset = 0;
+   mmap_file_size = 0;
+}
 
-   ret = pipe(parentToChild);
-   assert(ret == 0);
 
-   pid = fork();
-   switch (pid) {
-   case -1:
-      fprintf(stderr, "memtrail: warning: could not fork\n");
-      close(parentToChild[READ_FD]);
-      close(parentToChild[WRITE_FD]);
-      return open(name, oflag, mode);
+/*
+ * Rolling recording.
+ *
+ * When MEMTRAIL_ROLL is set, the trace is written as a sequence of segments,
+ * memtrail.data.0, memtrail.data.1, and so on, each with its own header and
+ * module and tag definitions, so that memtrail record can fold the oldest
+ * ones into a checkpoint while the application runs.  Its comma or newline
+ * separated rules are:
+ *
+ *   size=SIZE          start a new segment once SIZE bytes were written
+ *   interval=SECONDS   start a new segment every SECONDS
+ *
+ * SIZE may have a K, M, or G suffix.  Pending events are flushed into the
+ * segment they belong to before it is closed.
+ */
 
-   case 0:
-      // child
-      out = open(name, oflag, mode);
+#define ROLL_CHECK_PERIOD 4096 // updates between clock reads
 
-      ret = dup2(parentToChild[READ_FD], STDIN_FILENO);
-      assert(ret != -1);
-      ret = dup2(out, STDOUT_FILENO);
-      assert(ret != -1);
-      ret = close(parentToChild[WRITE_FD]);
-      assert(ret == 0);
+static bool rolling = false;
+static size_t roll_size = SIZE_MAX;
+static uint64_t roll_interval = 0; // nanoseconds
+static unsigned roll_countdown = ROLL_CHECK_PERIOD;
+static unsigned segment_no = 0;
+static size_t segment_written = 0;
+static uint64_t segment_start = 0;
 
-      // Don't want to track gzip
-      unsetenv("LD_PRELOAD");
 
-      execlp("gzip", "gzip", "--fast", NULL);
 
-      // This line should never be reached
-      abort();
+/*
+ * Record-time filtering.
+ *
+ * MEMTRAIL_FILTER holds comma or newline separated rules:
+ *
+ *   min-size=N, max-size=N       only record allocations within the range
+ *   include-module=SUBSTRING     only record allocations with a frame in a
+ *                                matching module
+ *   exclude-module=SUBSTRING     don't record allocations with a frame in a
+ *                                matching module
+ *
+ * Module rules are applied to the frames from the innermost outwards, and the
+ * first matching frame decides, just like memtrail report's filters.
+ * Filtered allocations are still accounted, but separately, and are never
+ * logged.  Those excluded by size are not unwound either, and only carry a
+ * compact header.
+ */
 
-   default:
-      // parent
-      ret = close(parentToChild[READ_FD]);
-      assert(ret == 0);
+static size_t filter_min_size = 0;
+static size_t filter_max_size = SIZE_MAX;
 
-      return parentToChild[WRITE_FD];
-   }
+static char include_modules[MAX_FILTER_RULES][MAX_FILTER_PATTERN];
+static unsigned numIncludeModules = 0;
+static char exclude_modules[MAX_FILTER_RULES][MAX_FILTER_PATTERN];
+static unsigned numExcludeModules = 0;
 
-   return -1;
-}
 
 
-static void
-_open(void) {
-   if (fd < 0) {
-      mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
-      fd = _gzopen("memtrail.data", O_WRONLY | O_CREAT | O_TRUNC, mode);
+/*
+ * Scalable exact accounting.
+ *
+ * Each thread accumulates its changes in a slot of its own, guarded by a
+ * per-slot lock that is normally only ever taken by its owner, so updates
+ * don't bounce a shared cache line between CPUs.  The maximum is kept exact
+ * by handing each slot an allowance, such that the committed total plus all
+ * allowances stays below the maximum: as long as no slot grows past its
+ * allowance, no new maximum can have been reached.  When one would, every
+ * slot is locked, folded into the committed total, the maximum checked
+ * precisely, and the remaining headroom redistributed.
+ *
+ * A heap that keeps growing leaves no headroom to distribute, and every
+ * allocation is then a new maximum anyway, so the counter then serializes:
+ * the slots are left empty and every change is committed directly under the
+ * counter mutex, which costs a single lock rather than locking every slot.
+ * It only distributes again once a decrement leaves COUNTER_MIN_ALLOWANCE
+ * bytes of headroom per slot.
+ *
+ * The slots also hold the lists of logged events pending to be flushed, so
+ * that threads can queue them without the global mutex while below the peak.
+ */
 
-      if (fd < 0) {
-         fprintf(stderr, "memtrail: error: could not open memtrail.data\n");
-         abort();
-      }
+#define CACHE_LINE_SIZE 64
 
-      unsigned char c = sizeof(void *);
-      ssize_t ret;
-      ret = ::write(fd, &c, sizeof c);
-      assert(ret >= 0);
-      assert((size_t)ret == sizeof c);
-   }
-}
+#define COUNTER_MIN_ALLOWANCE (64*1024)
 
 
+/**
+ * Hint the CPU that it's in a spin loop.
+ */
 static inline void
-_log(struct header_t *hdr) {
-   const void *ptr = hdr->ptr;
-   ssize_t ssize = hdr->allocated ? (ssize_t)hdr->size : -(ssize_t)hdr->size;
-
-   assert(ptr);
-   assert(ssize);
+_cpu_relax(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+   __builtin_ia32_pause();
+#elif defined(__aarch64__)
+   asm volatile ("yield");
+#endif
+}
 
-   _open();
 
-   PipeBuf buf(fd);
-   buf.write(&ptr, sizeof ptr);
-   buf.write(&ssize, sizeof ssize);
+struct CounterSlot {
+   int lock = 0;
+   ssize_t delta = 0;
+   ssize_t allowance = 0;
+   struct list_head pending = { nullptr, nullptr };
+} __attribute__((aligned(CACHE_LINE_SIZE)));
 
-   if (hdr->allocated) {
-      unsigned char c = (unsigned char) hdr->addr_count;
-      buf.write(&c, 1);
 
-      for (size_t i = 0; i < hdr->addr_count; ++i) {
-         void *addr = hdr->addrs[i];
-         _lookup(buf, addr);
+class ScalableCounter
+{
+protected:
+   pthread_mutex_t _mutex = PTHREAD_MUTEX_INITIALIZER;
+   CounterSlot _slots[MAX_THREADS];
+   unsigned _numSlots;
+   ssize_t _committed;
+   ssize_t _max;
+   bool _scalable;
+   bool _serialized;
+
+   void
+   _lockSlots(void) {
+      for (unsigned i = 0; i < _numSlots; ++i) {
+         lock(&_slots[i]);
       }
    }
+
+   void
+   _unlockSlots(void) {
+      for (unsigned i = 0; i < _numSlots; ++i) {
+         unlock(&_slots[i]);
+      }
+   }
+
+   /**
+    * Fold every slot into the committed total, preserving the sum of the
+    * committed total and allowances.  Must be called with the mutex and every
+    * slot lock held.
+    */
+   void
+   _fold(void) {
+      for (unsigned i = 0; i < _numSlots; ++i) {
+         _committed += _slots[i].delta;
+         _slots[i].allowance -= _slots[i].delta;
+         _slots[i].delta = 0;
+      }
+   }
+
+   /**
+    * Distribute the headroom among the slots, or serialize if there's too
+    * little.  Must be called with the mutex and every slot lock held, and the
+    * slots folded.
+    */
+   void
+   _distribute(void) {
+      ssize_t headroom = _max - _committed;
+      ssize_t allowance = 0;
+      _serialized = !_scalable || !_numSlots || headroom / _numSlots < COUNTER_MIN_ALLOWANCE;
+      if (!_serialized) {
+         // Keep the total strictly below the maximum
+         allowance = (headroom - 1) / _numSlots;
+      }
+      for (unsigned i = 0; i < _numSlots; ++i) {
+         _slots[i].allowance = allowance;
+      }
+   }
+
+public:
+   // Constant initialized, as filtered bytes are counted before constructors
+   // run
+   constexpr
+   ScalableCounter(bool scalable = true) :
+      _slots(),
+      _numSlots(0),
+      _committed(0),
+      _max(0),
+      _scalable(scalable),
+      _serialized(true)
+   {
+   }
+
+   static inline void
+   lock(CounterSlot *slot) {
+      while (__atomic_exchange_n(&slot->lock, 1, __ATOMIC_ACQUIRE)) {
+         while (__atomic_load_n(&slot->lock, __ATOMIC_RELAXED)) {
+            _cpu_relax();
+         }
+      }
+   }
+
+   static inline void
+   unlock(CounterSlot *slot) {
+      __atomic_store_n(&slot->lock, 0, __ATOMIC_RELEASE);
+   }
+
+   /**
+    * Whether slots may get allowances.  Must be called before any thread
+    * other than the first one updates the counter.
+    */
+   void
+   setScalable(bool scalable) {
+      _scalable = scalable;
+   }
+
+   /**
+    * Get the calling thread's slot, registering it on first use.
+    */
+   inline CounterSlot *
+   slot(CounterSlot *&cached) {
+      if (!cached) {
+         pthread_mutex_lock(&_mutex);
+         // Threads beyond MAX_THREADS share the last slot, which is still safe
+         unsigned index = std::min(_numSlots, (unsigned)MAX_THREADS - 1);
+         if (_numSlots < MAX_THREADS) {
+            CounterSlot *slot = &_slots[_numSlots];
+            slot->pending.prev = slot->pending.next = &slot->pending;
+            ++_numSlots;
+         }
+         pthread_mutex_unlock(&_mutex);
+         cached = &_slots[index];
+      }
+      return cached;
+   }
+
+   /**
+    * Account the change in the slot, if it can't reach a new maximum.  Must
+    * be called with the slot locked.
+    */
+   inline bool
+   tryAdd(CounterSlot *slot, ssize_t size) {
+      if (_serialized ||
+          (size > 0 && slot->delta + size > slot->allowance)) {
+         return false;
+      }
+      slot->delta += size;
+      return true;
+   }
+
+   /**
+    * Account the change exactly.
+    */
+   void
+   add(ssize_t size) {
+      pthread_mutex_lock(&_mutex);
+      if (_serialized) {
+         _committed += size;
+         if (_committed > _max) {
+            _max = _committed;
+         }
+         if (size < 0 && _scalable && _numSlots &&
+             (_max - _committed) / _numSlots >= COUNTER_MIN_ALLOWANCE) {
+            // The slots are empty, as nothing fits in them while serialized
+            _lockSlots();
+            _distribute();
+            _unlockSlots();
+         }
+      } else if (size <= 0) {
+         // Decrements never reach a new maximum
+         _committed += size;
+      } else {
+         _lockSlots();
+         _fold();
+         _committed += size;
+         if (_committed > _max) {
+            _max = _committed;
+         }
+         _distribute();
+         _unlockSlots();
+      }
+      pthread_mutex_unlock(&_mutex);
+   }
+
+   inline void
+   update(CounterSlot *&cached, ssize_t size) {
+      CounterSlot *slot = this->slot(cached);
+      lock(slot);
+      bool added = tryAdd(slot, size);
+      unlock(slot);
+      if (!added) {
+         add(size);
+      }
+   }
+
+   /**
+    * Whether the current value is the maximum.  Slots only get allowances
+    * below it, so it can only be while serialized.
+    */
+   bool
+   atPeak(void) {
+      pthread_mutex_lock(&_mutex);
+      bool peak = _serialized && _committed == _max;
+      pthread_mutex_unlock(&_mutex);
+      return peak;
+   }
+
+   /**
+    * Lock every slot, so that their lists can be walked.
+    */
+   void
+   freeze(unsigned *numSlots, CounterSlot **slots) {
+      pthread_mutex_lock(&_mutex);
+      _lockSlots();
+      *numSlots = _numSlots;
+      *slots = _slots;
+   }
+
+   void
+   thaw(void) {
+      _unlockSlots();
+      pthread_mutex_unlock(&_mutex);
+   }
+
+   /**
+    * Approximate current value, for limits.
+    */
+   inline ssize_t
+   estimate(void) const {
+      return __atomic_load_n(&_committed, __ATOMIC_RELAXED);
+   }
+
+   inline ssize_t
+   max(void) const {
+      return __atomic_load_n(&_max, __ATOMIC_RELAXED);
+   }
+
+   void
+   get(ssize_t *value, ssize_t *max) {
+      pthread_mutex_lock(&_mutex);
+      _lockSlots();
+      _fold();
+      *value = _committed;
+      *max = _max;
+      _unlockSlots();
+      pthread_mutex_unlock(&_mutex);
+   }
+};
+
+
+/*
+ * Allocations excluded by the filter are accounted apart, and logged ones in
+ * a counter that is only scalable when their events can be queued without
+ * the mutex.
+ */
+
+static ScalableCounter excluded_counter;
+
+static ScalableCounter logged_counter(false);
+
+static __thread CounterSlot *
+excluded_slot __attribute__((tls_model("initial-exec"))) = NULL;
+
+static __thread CounterSlot *
+logged_slot __attribute__((tls_model("initial-exec"))) = NULL;
+
+
+/*
+ * Self-instrumentation.
+ *
+ * Unwinding, waiting for the mutex, and queuing events happen concurrently, so
+ * they are accounted in per-thread slots, while everything else happens with
+ * the mutex held.  Times are taken in ticks of the cheapest clock available
+ * (the TSC on x86, the virtual counter on aarch64, or else the monotonic
+ * clock), and only converted to nanoseconds at exit.
+ */
+
+struct ThreadStats {
+   uint64_t events;
+   uint64_t unwinds;
+   uint64_t frames;
+   uint64_t unwind_cycles;
+   uint64_t lock_waits;
+   uint64_t lock_wait_cycles;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+static ThreadStats thread_stats[MAX_THREADS];
+static unsigned numThreadStats = 0;
+
+static __thread ThreadStats *
+thread_stats_slot __attribute__((tls_model("initial-exec"))) = NULL;
+
+static struct {
+   uint64_t symbol_lookups;
+   uint64_t symbol_misses;
+   uint64_t symbol_miss_cycles;
+   uint64_t flushes;
+   uint64_t flush_cycles;
+   uint64_t bytes_written;
+   uint64_t write_cycles;
+} stats;
+
+static uint64_t start_cycles = 0;
+static uint64_t start_ns = 0;
+
+
+enum
+{
+   STAT_EVENTS,
+   STAT_UNWINDS,
+   STAT_FRAMES,
+   STAT_UNWIND_NS,
+   STAT_SYMBOL_LOOKUPS,
+   STAT_SYMBOL_MISSES,
+   STAT_SYMBOL_MISS_NS,
+   STAT_FLUSHES,
+   STAT_FLUSH_NS,
+   STAT_BYTES_WRITTEN,
+   STAT_WRITE_NS,
+   STAT_LOCK_WAITS,
+   STAT_LOCK_WAIT_NS,
+   NUM_STATS
+};
+
+
+static inline uint64_t
+_monotonic_ns(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static inline uint64_t
+_cycles(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+   return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+   uint64_t ticks;
+   asm volatile ("mrs %0, cntvct_el0" : "=r" (ticks));
+   return ticks;
+#else
+   return _monotonic_ns();
+#endif
+}
+
+
+static inline ThreadStats *
+_thread_stats(void)
+{
+   ThreadStats *slot = thread_stats_slot;
+   if (!slot) {
+      // Threads beyond MAX_THREADS share the last slot, and may lose counts
+      unsigned index = __atomic_fetch_add(&numThreadStats, 1, __ATOMIC_RELAXED);
+      slot = &thread_stats[std::min(index, (unsigned)MAX_THREADS - 1)];
+      thread_stats_slot = slot;
+   }
+   return slot;
+}
+
+
+/**
+ * Add to a per-thread counter, which is only read racily, at exit.
+ */
+static inline void
+_stat_add(uint64_t *counter, uint64_t value)
+{
+   __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
 }
 
+
+/**
+ * Sum up the counters, with the times in nanoseconds.  Must be called with the
+ * mutex held.
+ */
 static void
-_flush(void) {
-   struct header_t *it;
-   struct header_t *tmp;
-   for (it = (struct header_t *)hdr_list.next,
-	     tmp = (struct header_t *)it->list_head.next;
-        &it->list_head != &hdr_list;
-	     it = tmp, tmp = (struct header_t *)tmp->list_head.next) {
-      assert(it->pending);
-      if (VERBOSITY >= 2) fprintf(stderr, "flush %p %zu\n", &it[1], it->size);
-      if (!it->internal) {
-         _log(it);
-      }
-      list_del(&it->list_head);
-      if (!it->allocated) {
-         __libc_free(it->ptr);
-         it = nullptr;
+_get_stats(uint64_t values[NUM_STATS])
+{
+   ThreadStats total;
+   memset(&total, 0, sizeof total);
+   unsigned numSlots = std::min(__atomic_load_n(&numThreadStats, __ATOMIC_RELAXED), (unsigned)MAX_THREADS);
+   for (unsigned i = 0; i < numSlots; ++i) {
+      const ThreadStats *slot = &thread_stats[i];
+      total.events += __atomic_load_n(&slot->events, __ATOMIC_RELAXED);
+      total.unwinds += __atomic_load_n(&slot->unwinds, __ATOMIC_RELAXED);
+      total.frames += __atomic_load_n(&slot->frames, __ATOMIC_RELAXED);
+      total.unwind_cycles += __atomic_load_n(&slot->unwind_cycles, __ATOMIC_RELAXED);
+      total.lock_waits += __atomic_load_n(&slot->lock_waits, __ATOMIC_RELAXED);
+      total.lock_wait_cycles += __atomic_load_n(&slot->lock_wait_cycles, __ATOMIC_RELAXED);
+   }
+
+   // Calibrate the ticks against the clock over the whole run
+   uint64_t elapsed_cycles = _cycles() - start_cycles;
+   double ns_per_cycle = elapsed_cycles ? (double)(_monotonic_ns() - start_ns) / elapsed_cycles : 0.0;
+
+   values[STAT_EVENTS] = total.events;
+   values[STAT_UNWINDS] = total.unwinds;
+   values[STAT_FRAMES] = total.frames;
+   values[STAT_UNWIND_NS] = total.unwind_cycles * ns_per_cycle;
+   values[STAT_SYMBOL_LOOKUPS] = stats.symbol_lookups;
+   values[STAT_SYMBOL_MISSES] = stats.symbol_misses;
+   values[STAT_SYMBOL_MISS_NS] = stats.symbol_miss_cycles * ns_per_cycle;
+   values[STAT_FLUSHES] = stats.flushes;
+   values[STAT_FLUSH_NS] = stats.flush_cycles * ns_per_cycle;
+   values[STAT_BYTES_WRITTEN] = stats.bytes_written;
+   values[STAT_WRITE_NS] = stats.write_cycles * ns_per_cycle;
+   values[STAT_LOCK_WAITS] = total.lock_waits;
+   values[STAT_LOCK_WAIT_NS] = total.lock_wait_cycles * ns_per_cycle;
+}
+
+
+static void
+_parse_filter(const char *rules)
+{
+   while (*rules) {
+      size_t len = strcspn(rules, ",\n");
+      const char *value = (const char *)memchr(rules, '=', len);
+      if (value) {
+         size_t key_len = value - rules;
+         ++value;
+         size_t value_len = len - key_len - 1;
+
+         char (*patterns)[MAX_FILTER_PATTERN] = NULL;
+         unsigned *numPatterns = NULL;
+         if (key_len == 8 && strncmp(rules, "min-size", key_len) == 0) {
+            filter_min_size = strtoull(value, NULL, 0);
+         } else if (key_len == 8 && strncmp(rules, "max-size", key_len) == 0) {
+            filter_max_size = strtoull(value, NULL, 0);
+         } else if (key_len == 14 && strncmp(rules, "include-module", key_len) == 0) {
+            patterns = include_modules;
+            numPatterns = &numIncludeModules;
+         } else if (key_len == 14 && strncmp(rules, "exclude-module", key_len) == 0) {
+            patterns = exclude_modules;
+            numPatterns = &numExcludeModules;
+         } else {
+            fprintf(stderr, "memtrail: warning: unknown filter rule %.*s\n", (int)len, rules);
+         }
+
+         if (patterns) {
+            if (*numPatterns < MAX_FILTER_RULES && value_len < MAX_FILTER_PATTERN) {
+               memcpy(patterns[*numPatterns], value, value_len);
+               patterns[*numPatterns][value_len] = 0;
+               ++*numPatterns;
+            } else {
+               fprintf(stderr, "memtrail: warning: ignoring filter rule %.*s\n", (int)len, rules);
+            }
+         }
+      } else if (len) {
+         fprintf(stderr, "memtrail: warning: malformed filter rule %.*s\n", (int)len, rules);
+      }
+
+      rules += len;
+      if (*rules) {
+         ++rules;
+      }
+   }
+}
+
+
+/**
+ * Whether frames in the given module include (positive) or exclude (negative)
+ * allocations, if at all.
+ */
+static int
+_module_verdict(const char *path)
+{
+   for (unsigned i = 0; i < numIncludeModules; ++i) {
+      if (strstr(path, include_modules[i])) {
+         return 1;
+      }
+   }
+   for (unsigned i = 0; i < numExcludeModules; ++i) {
+      if (strstr(path, exclude_modules[i])) {
+         return -1;
+      }
+   }
+   return 0;
+}
+
+
+struct Module {
+   const char *dli_fname;
+   void       *dli_fbase;
+   bool        defined; // whether its definition was logged
+   signed char verdict;
+};
+
+static Module modules[MAX_MODULES];
+static unsigned numModules = 0;
+
+struct Symbol {
+   void *addr;
+   Module *module;
+};
+
+static Symbol symbols[MAX_SYMBOLS];
+
+
+
+/*
+ * Buffer of events, written out as a single chunk.
+ *
+ * Pointers are encoded as deltas against the previous event's, which restart
+ * with every chunk, so that chunks can still be decoded independently.
+ */
+class PipeBuf
+{
+protected:
+   int _fd;
+   // Room for the chunk length, the payload, and its padding
+   char _buf[sizeof(uint32_t) + PIPE_BUF + sizeof(uint32_t)];
+   size_t _written;
+   uintptr_t _prev;
+
+public:
+   inline
+   PipeBuf(int fd) :
+      _fd(fd),
+      _written(0),
+      _prev(0)
+   {
+   }
+
+   /**
+    * Start a new chunk unless there's room for nbytes more.
+    */
+   inline void
+   reserve(size_t nbytes) {
+      assert(nbytes <= PIPE_BUF);
+      if (_written + nbytes > PIPE_BUF) {
+         flush();
+      }
+   }
+
+   /**
+    * Write an unsigned LEB128 varint.
+    */
+   inline void
+   write_varint(size_t value) {
+      unsigned char bytes[(sizeof value * 8 + 6) / 7];
+      size_t n = 0;
+      while (value >= 0x80) {
+         bytes[n++] = (unsigned char)value | 0x80;
+         value >>= 7;
+      }
+      bytes[n++] = (unsigned char)value;
+      write(bytes, n);
+   }
+
+   /**
+    * Write a signed varint, zigzag encoded so small magnitudes stay short.
+    */
+   inline void
+   write_signed(ssize_t value) {
+      write_varint(((size_t)value << 1) ^ (size_t)(value >> (sizeof value * 8 - 1)));
+   }
+
+   /**
+    * Write an event's pointer, as the delta against the previous one, offset
+    * by one so that zero can introduce special events.
+    */
+   inline void
+   write_pointer(const void *ptr) {
+      uintptr_t value = (uintptr_t)ptr;
+      intptr_t delta = (intptr_t)(value - _prev);
+      _prev = value;
+      write_varint((((uintptr_t)delta << 1) ^ (uintptr_t)(delta >> (sizeof delta * 8 - 1))) + 1);
+   }
+
+   inline void
+   write_special(ssize_t event) {
+      write_varint(0);
+      write_signed(event);
+   }
+
+   inline void
+   write(const void *buf, size_t nbytes) {
+      if (!RECORD) {
+         return;
+      }
+
+      if (nbytes) {
+         assert(_written + nbytes <= PIPE_BUF);
+         memcpy(_buf + sizeof(uint32_t) + _written, buf, nbytes);
+         _written += nbytes;
+      }
+   }
+
+   inline void
+   flush(void) {
+      if (!RECORD) {
+         return;
+      }
+
+      if (_written) {
+         assert(_fd >= 0);
+         uint64_t start = _cycles();
+         if (use_mmap) {
+            _mmap_append(_buf + sizeof(uint32_t), _written);
+            segment_written += sizeof(uint32_t) + _written;
+            stats.bytes_written += sizeof(uint32_t) + _written;
+         } else {
+            uint32_t length = _written;
+            size_t padded = (_written + sizeof length - 1) & ~(sizeof length - 1);
+            memcpy(_buf, &length, sizeof length);
+            memset(_buf + sizeof length + _written, 0, padded - _written);
+
+            ssize_t ret;
+            ret = ::write(_fd, _buf, sizeof length + padded);
+            assert(ret >= 0);
+            assert((size_t)ret == sizeof length + padded);
+            segment_written += sizeof length + padded;
+            stats.bytes_written += sizeof length + padded;
+         }
+         stats.write_cycles += _cycles() - start;
+         _written = 0;
+         _prev = 0;
+      }
+   }
+
+
+   inline
+   ~PipeBuf(void) {
+      flush();
+   }
+};
+
+
+static Symbol *
+_symbol(void *addr) {
+   unsigned key = (size_t)addr % MAX_SYMBOLS;
+
+   Symbol *sym = &symbols[key];
+
+   ++stats.symbol_lookups;
+   if (sym->addr != addr) {
+      uint64_t start = _cycles();
+      ++stats.symbol_misses;
+
+      Dl_info info;
+      if (_dladdr(addr, &info)) {
+         Module *module = NULL;
+         for (unsigned i = 0; i < numModules; ++i) {
+            if (strcmp(modules[i].dli_fname, info.dli_fname) == 0) {
+               module = &modules[i];
+               break;
+            }
+         }
+         if (!module && numModules < ARRAY_SIZE(modules)) {
+            module = &modules[numModules++];
+            module->dli_fname = info.dli_fname;
+            module->dli_fbase = info.dli_fbase;
+            module->defined = false;
+            module->verdict = _module_verdict(info.dli_fname);
+         }
+         sym->module = module;
       } else {
-         it->pending = false;
+         sym->module = NULL;
       }
+
+      sym->addr = addr;
+
+      stats.symbol_miss_cycles += _cycles() - start;
+   }
+
+   return sym;
+}
+
+
+static void
+_lookup(PipeBuf &buf, void *addr) {
+   Symbol *sym = _symbol(addr);
+
+   bool newModule = false;
+   if (sym->module && !sym->module->defined) {
+      sym->module->defined = true;
+      newModule = true;
+   }
+
+   size_t offset;
+   const char * name;
+   unsigned char moduleNo;
+
+   if (sym->module) {
+      name = sym->module->dli_fname;
+      offset = ((size_t)addr - (size_t)sym->module->dli_fbase);
+      moduleNo = 1 + sym->module - modules;
+   } else {
+      name = "";
+      offset = (size_t)addr;
+      moduleNo = 0;
+   }
+
+   // The address is implied by the module base and the offset
+   buf.write_varint((size_t)moduleNo << 1 | newModule);
+   buf.write_varint(offset);
+   if (newModule) {
+      size_t len = strlen(name);
+      buf.write_varint((size_t)sym->module->dli_fbase);
+      buf.write_varint(len);
+      buf.write(name, len);
+   }
+}
+
+
+/**
+ * Upper bound of the bytes needed to log the given frames, including the
+ * definitions of the modules not logged yet.
+ */
+static size_t
+_frames_size(void * const *addrs, size_t count)
+{
+   static const size_t max_varint = (sizeof(size_t) * 8 + 6) / 7;
+
+   size_t size = max_varint + count * 2 * max_varint;
+   for (size_t i = 0; i < count; ++i) {
+      Symbol *sym = _symbol(addrs[i]);
+      if (sym->module && !sym->module->defined) {
+         size += 2 * max_varint + strlen(sym->module->dli_fname);
+      }
+   }
+   return size;
+}
+
+
+/**
+ * Whether the allocation passes the module filter rules.
+ */
+static bool
+_filter_stack(const struct header_t *hdr)
+{
+   for (unsigned i = 0; i < hdr->addr_count; ++i) {
+      Symbol *sym = _symbol(hdr->addrs[i]);
+      if (sym->module && sym->module->verdict) {
+         return sym->module->verdict > 0;
+      }
+   }
+   return !numIncludeModules;
+}
+
+
+enum
+{
+   READ_FD  = 0,
+   WRITE_FD = 1
+};
+
+
+/**
+ * Open a compressed stream for writing by forking a gzip process.
+ */
+static int
+_gzopen(const char *name, int oflag, mode_t mode)
+{
+   int       parentToChild[2];
+   pid_t     pid;
+   int out;
+   int ret;
+
+   ret = pipe(parentToChild);
+   assert(ret == 0);
+
+   pid = fork();
+   switch (pid) {
+   case -1:
+      fprintf(stderr, "memtrail: warning: could not fork\n");
+      close(parentToChild[READ_FD]);
+      close(parentToChild[WRITE_FD]);
+      return open(name, oflag, mode);
+
+   case 0:
+      // child
+      out = open(name, oflag, mode);
+
+      ret = dup2(parentToChild[READ_FD], STDIN_FILENO);
+      assert(ret != -1);
+      ret = dup2(out, STDOUT_FILENO);
+      assert(ret != -1);
+      ret = close(parentToChild[WRITE_FD]);
+      assert(ret == 0);
+
+      // Don't want to track gzip
+      unsetenv("LD_PRELOAD");
+
+      execlp("gzip", "gzip", "--fast", NULL);
+
+      // This line should never be reached
+      abort();
+
+   default:
+      // parent
+      ret = close(parentToChild[READ_FD]);
+      assert(ret == 0);
+
+      // Keep the application's children from holding the pipe open, lest
+      // gzip never finishes a retired segment
+      fcntl(parentToChild[WRITE_FD], F_SETFD, FD_CLOEXEC);
+
+      return parentToChild[WRITE_FD];
+   }
+
+   return -1;
+}
+
+
+/**
+ * Create the output, or the next segment of a rolling recording, and write
+ * its header.  The previous one, if any, must have been closed.
+ */
+static void
+_create(void) {
+   char name[32] = "memtrail.data";
+   if (rolling) {
+      snprintf(name, sizeof name, "memtrail.data.%u", segment_no);
+   }
+
+   mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
+   if (use_mmap) {
+      fd = open(name, O_RDWR | O_CREAT | O_TRUNC, mode);
+   } else {
+      fd = _gzopen(name, O_WRONLY | O_CREAT | O_TRUNC, mode);
+   }
+
+   if (fd < 0) {
+      fprintf(stderr, "memtrail: error: could not open %s\n", name);
+      abort();
+   }
+
+   segment_written = 0;
+
+   struct timespec ts;
+   clock_gettime(CLOCK_REALTIME, &ts);
+
+   struct file_header_t header;
+   memcpy(header.magic, FORMAT_MAGIC, sizeof header.magic);
+   header.version = FORMAT_VERSION;
+   header.pointer_size = sizeof(void *);
+   header.page_size = sysconf(_SC_PAGESIZE);
+   header.flags = FLAG_CHUNKED | FLAG_MODULE_DEFS;
+   if (!record_stacks) {
+      header.flags |= FLAG_TAGS_ONLY;
+   }
+   if (use_mmap) {
+      header.flags |= FLAG_MMAP;
+   }
+   if (scan_enabled) {
+      header.flags |= FLAG_SCAN;
+   }
+   if (filter_min_size || filter_max_size != SIZE_MAX || numIncludeModules || numExcludeModules) {
+      header.flags |= FLAG_FILTERED;
+   }
+   header.pid = getpid();
+   header.time_base = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+   if (use_mmap) {
+      if (!_mmap_copy(0, &header, sizeof header)) {
+         fprintf(stderr, "memtrail: error: could not map %s\n", name);
+         abort();
+      }
+      mmap_offset = sizeof header;
+   } else {
+      ssize_t ret;
+      ret = ::write(fd, &header, sizeof header);
+      assert(ret >= 0);
+      assert((size_t)ret == sizeof header);
+   }
+}
+
+
+static void
+_open(void) {
+   if (fd < 0) {
+      _create();
+   }
+}
+
+
+/**
+ * Address of the allocation as seen by the application.
+ */
+static inline const void *
+_user_ptr(const struct header_t *hdr)
+{
+   return hdr->custom || hdr->detached ? hdr->ptr : &hdr[1];
+}
+
+
+/**
+ * Release the memory behind a freed allocation.
+ */
+static inline void
+_release(struct header_t *hdr)
+{
+   if (hdr->detached) {
+      __libc_free(hdr->ptr);
+   }
+   __libc_free(hdr->custom || hdr->detached ? hdr : hdr->ptr);
+}
+
+
+/*
+ * glibc's malloc chunk geometry, used to emulate the size class an allocation
+ * would have landed in, had memtrail not prepended its own header.
+ */
+#define GLIBC_SIZE_SZ (sizeof(size_t))
+#define GLIBC_MALLOC_ALIGNMENT (2 * GLIBC_SIZE_SZ < __alignof__(long double) ? __alignof__(long double) : 2 * GLIBC_SIZE_SZ)
+#define GLIBC_MALLOC_ALIGN_MASK (GLIBC_MALLOC_ALIGNMENT - 1)
+#define GLIBC_MINSIZE ((4 * GLIBC_SIZE_SZ + GLIBC_MALLOC_ALIGN_MASK) & ~GLIBC_MALLOC_ALIGN_MASK)
+#define GLIBC_MMAP_THRESHOLD (128 * 1024)
+#define GLIBC_IS_MMAPPED 0x2
+
+
+/**
+ * Whether glibc's fresh mmapped chunks can be relied upon to be zeroed, i.e.,
+ * malloc perturbation is not enabled.  Only known once started.
+ */
+static bool mmapped_zeroed = false;
+
+
+static inline bool
+_chunk_is_mmapped(const void *ptr)
+{
+   return ((const size_t *)ptr)[-1] & GLIBC_IS_MMAPPED;
+}
+
+
+/**
+ * Usable size of the block glibc would hand out for a request of the given
+ * size.
+ *
+ * malloc_usable_size() of our own blocks is meaningless, as these are inflated
+ * by the header and alignment padding, so emulate glibc's request2size()
+ * instead.  The mmap threshold is assumed to be the default one.
+ */
+static inline size_t
+_usable_size(size_t size)
+{
+   size_t chunk_size = size + GLIBC_SIZE_SZ + GLIBC_MALLOC_ALIGN_MASK;
+   if (chunk_size < GLIBC_MINSIZE) {
+      return GLIBC_MINSIZE - GLIBC_SIZE_SZ;
+   }
+   chunk_size &= ~GLIBC_MALLOC_ALIGN_MASK;
+
+   if (chunk_size >= GLIBC_MMAP_THRESHOLD) {
+      // mmapped chunks are rounded to pages, and have two size words
+      chunk_size = (chunk_size + GLIBC_SIZE_SZ + pagesize - 1) & ~(pagesize - 1);
+      return chunk_size - 2 * GLIBC_SIZE_SZ;
+   }
+
+   // The next chunk's prev_size word is usable while this one is in use
+   return chunk_size - GLIBC_SIZE_SZ;
+}
+
+
+/*
+ * Upper bound of the bytes an event takes, besides its frames.
+ */
+#define MAX_EVENT_SIZE 128
+
+static inline void
+_log(PipeBuf &buf, struct header_t *hdr) {
+   const void *ptr = _user_ptr(hdr);
+   ssize_t ssize = hdr->allocated ? (ssize_t)hdr->size : -(ssize_t)hdr->size;
+
+   assert(ptr);
+   assert(ssize);
+
+   if (hdr->allocated) {
+      buf.reserve(MAX_EVENT_SIZE + _frames_size(hdr->addrs, hdr->addr_count));
+   } else {
+      buf.reserve(MAX_EVENT_SIZE);
+   }
+
+   if (hdr->custom) {
+      buf.write_special(EVENT_CUSTOM);
+   }
+   if (hdr->allocated && hdr->tag) {
+      buf.write_special(EVENT_TAG);
+      buf.write_varint(hdr->tag);
+   }
+   if (hdr->allocated && hdr->realloc_steps) {
+      buf.write_special(EVENT_REALLOC);
+      buf.write_varint(hdr->realloc_steps);
+      buf.write_varint(hdr->realloc_copied);
+      buf.write_varint(hdr->realloc_origin);
+   }
+   buf.write_pointer(ptr);
+   buf.write_signed(ssize);
+
+   if (hdr->allocated) {
+      // Log the slack rather than the usable size, as it's much smaller
+      size_t usable = hdr->custom ? hdr->size :
+                      hdr->detached ? malloc_usable_size(hdr->ptr) :
+                      _usable_size(hdr->size);
+      buf.write_varint(usable - hdr->size);
+
+      buf.write_varint(hdr->addr_count);
+
+      for (size_t i = 0; i < hdr->addr_count; ++i) {
+         void *addr = hdr->addrs[i];
+         _lookup(buf, addr);
+      }
+   }
+}
+
+/**
+ * Log the end of a realloc chain.
+ *
+ * The blocks of a chain are usually freed before they are ever flushed, so
+ * the chain is summarized when its last block is freed, which is logged
+ * straight away.
+ */
+static inline void
+_log_realloc_chain(PipeBuf &buf, struct header_t *hdr) {
+   buf.reserve(MAX_EVENT_SIZE + _frames_size(hdr->addrs, hdr->addr_count));
+
+   buf.write_special(EVENT_REALLOC_CHAIN);
+   buf.write_varint(hdr->realloc_steps);
+   buf.write_varint(hdr->realloc_copied);
+   buf.write_varint(hdr->realloc_origin);
+   buf.write_varint(hdr->size);
+   buf.write_varint(hdr->tag);
+
+   buf.write_varint(hdr->addr_count);
+
+   for (size_t i = 0; i < hdr->addr_count; ++i) {
+      void *addr = hdr->addrs[i];
+      _lookup(buf, addr);
+   }
+}
+
+/**
+ * Whether the thread is flushing, and so holds every slot lock.
+ */
+static __thread bool
+flushing __attribute__((tls_model("initial-exec"))) = false;
+
+/**
+ * Log the pending events.  Must be called with the mutex held.
+ */
+static void
+_flush(void) {
+   struct header_t *it;
+   struct header_t *tmp;
+   unsigned numSlots;
+   CounterSlot *slots;
+
+   logged_counter.freeze(&numSlots, &slots);
+
+   // Don't open the output for internal allocations alone, as allocations
+   // are presumed internal until it is
+   unsigned numLists = 0;
+   bool external = false;
+   for (unsigned i = 0; i < numSlots; ++i) {
+      struct list_head *list = &slots[i].pending;
+      if (list->next != list) {
+         ++numLists;
+      }
+      for (it = LIST_ENTRY(struct header_t, list->next, list_head);
+           &it->list_head != list && it->internal;
+           it = LIST_ENTRY(struct header_t, it->list_head.next, list_head))
+         ;
+      external = external || &it->list_head != list;
+   }
+
+   if (!numLists) {
+      logged_counter.thaw();
+      return;
+   }
+
+   uint64_t start = _cycles();
+   ++stats.flushes;
+
+   flushing = true;
+
+   if (external) {
+      _open();
+   }
+
+   {
+      // Batch the events in as few chunks as possible
+      PipeBuf buf(fd);
+
+      // Events queued by different threads are only ordered per address,
+      // and addresses aren't reused until their frees are flushed, so
+      // logging all frees before all allocations never overshoots the
+      // maximum, while yielding the same final state
+      for (int pass = numLists > 1 ? 0 : 1; pass < 2; ++pass) {
+         for (unsigned i = 0; i < numSlots; ++i) {
+            struct list_head *list = &slots[i].pending;
+            for (it = LIST_ENTRY(struct header_t, list->next, list_head),
+                 tmp = LIST_ENTRY(struct header_t, it->list_head.next, list_head);
+                 &it->list_head != list;
+                 it = tmp, tmp = LIST_ENTRY(struct header_t, tmp->list_head.next, list_head)) {
+               assert(it->pending == &slots[i]);
+               if (pass == 0 && it->allocated) {
+                  continue;
+               }
+               if (VERBOSITY >= 2) fprintf(stderr, "flush %p %zu\n", _user_ptr(it), it->size);
+               if (!it->internal) {
+                  _log(buf, it);
+               }
+               list_del(&it->list_head);
+               if (!it->allocated) {
+                  _release(it);
+                  it = nullptr;
+               } else {
+                  __atomic_store_n(&it->pending, nullptr, __ATOMIC_RELAXED);
+               }
+            }
+         }
+      }
+   }
+
+   flushing = false;
+
+   logged_counter.thaw();
+
+   stats.flush_cycles += _cycles() - start;
+}
+
+/*
+ * Allocation tags.
+ */
+
+static __thread unsigned short
+tag_stack[MAX_TAG_DEPTH] __attribute__((tls_model("initial-exec")));
+
+static __thread unsigned
+tag_depth __attribute__((tls_model("initial-exec"))) = 0;
+
+static inline unsigned short
+_current_tag(void)
+{
+   unsigned depth = tag_depth;
+   if (!depth) {
+      return 0;
+   }
+   return tag_stack[std::min(depth, (unsigned)MAX_TAG_DEPTH) - 1];
+}
+
+static char *tag_names[MAX_TAGS];
+static unsigned numTags = 1;
+
+// Cache of tag name pointers to tag ids, as names are usually literals.
+// Entries are only ever added, with the mutex held, and publish the name
+// after the id, so that lookups needn't take the mutex.
+static struct {
+   const char *name;
+   unsigned short id;
+} tag_cache[2 * MAX_TAGS];
+static unsigned numTagCacheEntries = 0;
+
+
+static void
+_log_tag_name(PipeBuf &buf, unsigned short id)
+{
+   size_t len = strlen(tag_names[id]);
+   buf.reserve(MAX_EVENT_SIZE + len);
+   buf.write_special(EVENT_TAG_NAME);
+   buf.write_varint(id);
+   buf.write_varint(len);
+   buf.write(tag_names[id], len);
+}
+
+
+/**
+ * Look up the id of a tag name pointer in the cache, without the mutex.
+ * Returns zero if missing.
+ */
+static inline unsigned short
+_cached_tag_id(const char *name)
+{
+   size_t key = ((uintptr_t)name >> 3) % ARRAY_SIZE(tag_cache);
+   const char *cached;
+   while ((cached = __atomic_load_n(&tag_cache[key].name, __ATOMIC_ACQUIRE))) {
+      if (cached == name) {
+         return tag_cache[key].id;
+      }
+      key = (key + 1) % ARRAY_SIZE(tag_cache);
+   }
+   return 0;
+}
+
+
+/**
+ * Translate a tag name into an id, logging its definition on first use.  Must
+ * be called with the mutex held.
+ */
+static unsigned short
+_tag_id(const char *name)
+{
+   size_t key = ((uintptr_t)name >> 3) % ARRAY_SIZE(tag_cache);
+   while (tag_cache[key].name) {
+      if (tag_cache[key].name == name) {
+         return tag_cache[key].id;
+      }
+      key = (key + 1) % ARRAY_SIZE(tag_cache);
+   }
+
+   unsigned short id = 0;
+   for (unsigned i = 1; i < numTags; ++i) {
+      if (strncmp(tag_names[i], name, MAX_TAG_NAME - 1) == 0) {
+         id = i;
+         break;
+      }
+   }
+
+   if (!id) {
+      if (numTags >= ARRAY_SIZE(tag_names)) {
+         fprintf(stderr, "memtrail: warning: too many tags\n");
+         return 0;
+      }
+
+      size_t len = strnlen(name, MAX_TAG_NAME - 1);
+      char *copy = (char *)__libc_malloc(len + 1);
+      if (!copy) {
+         return 0;
+      }
+      memcpy(copy, name, len);
+      copy[len] = 0;
+
+      id = numTags++;
+      tag_names[id] = copy;
+
+      _open();
+
+      PipeBuf buf(fd);
+      _log_tag_name(buf, id);
+   }
+
+   if (numTagCacheEntries < ARRAY_SIZE(tag_cache) / 2) {
+      tag_cache[key].id = id;
+      __atomic_store_n(&tag_cache[key].name, name, __ATOMIC_RELEASE);
+      ++numTagCacheEntries;
+   }
+
+   return id;
+}
+
+
+/*
+ * Reachability scan.
+ *
+ * When MEMTRAIL_SCAN is set, live blocks are kept in a list so that, at exit,
+ * they can be conservatively marked as reachable from the writable segments of
+ * the loaded modules and from the thread stacks -- much like a mark-and-sweep
+ * garbage collector would do -- and the unreachable ones logged.
+ */
+
+// Allocations made while scanning (e.g., by pthread_create) are not the
+// application's
+static bool scanning = false;
+
+struct list_head
+live_list = { &live_list, &live_list };
+
+
+struct ThreadStack {
+   char *lo;
+   char *hi;
+};
+
+static ThreadStack thread_stacks[MAX_THREADS];
+
+static pthread_key_t thread_key;
+
+static __thread bool
+thread_registered __attribute__((tls_model("initial-exec"))) = false;
+
+
+static void
+_unregister_thread(void *arg)
+{
+   ThreadStack *stack = (ThreadStack *)arg;
+
+   pthread_mutex_lock(&mutex);
+   stack->lo = NULL;
+   stack->hi = NULL;
+   pthread_mutex_unlock(&mutex);
+}
+
+
+/**
+ * Remember the calling thread's stack, so that it can be scanned for roots.
+ */
+static void
+_register_thread(void)
+{
+   // pthread_getattr_np() may allocate
+   thread_registered = true;
+
+   pthread_attr_t attr;
+   if (pthread_getattr_np(pthread_self(), &attr) != 0) {
+      return;
+   }
+   void *addr = NULL;
+   size_t size = 0;
+   pthread_attr_getstack(&attr, &addr, &size);
+   pthread_attr_destroy(&attr);
+
+   pthread_mutex_lock(&mutex);
+   for (unsigned i = 0; i < ARRAY_SIZE(thread_stacks); ++i) {
+      ThreadStack *stack = &thread_stacks[i];
+      if (!stack->hi) {
+         stack->lo = (char *)addr;
+         stack->hi = (char *)addr + size;
+         pthread_setspecific(thread_key, stack);
+         break;
+      }
+   }
+   pthread_mutex_unlock(&mutex);
+}
+
+
+struct Block {
+   uintptr_t lo;
+   uintptr_t hi;
+   struct header_t *hdr;
+};
+
+static Block *blocks;
+static size_t numBlocks;
+static unsigned char *marks;
+
+// Shared stack of marked blocks whose contents are yet to be scanned.  Every
+// block is pushed at most once, so it never needs more than numBlocks entries.
+static size_t *scan_stack;
+static size_t scan_top;
+static unsigned scan_threads;
+static unsigned scan_idle;
+static bool scan_done;
+static pthread_mutex_t scan_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scan_cond = PTHREAD_COND_INITIALIZER;
+
+
+static void
+_scan_push(const size_t *indices, size_t count)
+{
+   if (!count) {
+      return;
+   }
+   pthread_mutex_lock(&scan_mutex);
+   assert(scan_top + count <= numBlocks);
+   memcpy(scan_stack + scan_top, indices, count * sizeof *indices);
+   scan_top += count;
+   pthread_cond_broadcast(&scan_cond);
+   pthread_mutex_unlock(&scan_mutex);
+}
+
+
+/**
+ * Mark the blocks pointed by the words in [lo, hi), appending the newly marked
+ * ones to the given batch, and flushing it to the shared stack when full.
+ */
+static void
+_scan_words(uintptr_t lo, uintptr_t hi, size_t *batch, size_t *count)
+{
+   if (!numBlocks) {
+      return;
+   }
+
+   uintptr_t min = blocks[0].lo;
+   uintptr_t max = blocks[numBlocks - 1].hi;
+
+   lo = (lo + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+   for (const uintptr_t *p = (const uintptr_t *)lo; (uintptr_t)(p + 1) <= hi; ++p) {
+      uintptr_t value = *p;
+      if (value < min || value >= max) {
+         continue;
+      }
+
+      // Find the last block starting at or before value.  Interior pointers
+      // count too.
+      size_t first = 0;
+      size_t last = numBlocks;
+      while (last - first > 1) {
+         size_t middle = first + (last - first) / 2;
+         if (blocks[middle].lo <= value) {
+            first = middle;
+         } else {
+            last = middle;
+         }
+      }
+      if (value >= blocks[first].hi) {
+         continue;
+      }
+
+      if (marks[first] || __atomic_exchange_n(&marks[first], 1, __ATOMIC_RELAXED)) {
+         continue;
+      }
+
+      batch[(*count)++] = first;
+      if (*count == SCAN_BATCH) {
+         _scan_push(batch, *count);
+         *count = 0;
+      }
+   }
+}
+
+
+static void *
+_scan_worker(void *arg)
+{
+   size_t work[SCAN_BATCH];
+   size_t batch[SCAN_BATCH];
+   size_t count = 0;
+
+   (void)arg;
+
+   while (true) {
+      pthread_mutex_lock(&scan_mutex);
+      while (!scan_top && !scan_done) {
+         if (++scan_idle == scan_threads) {
+            scan_done = true;
+            pthread_cond_broadcast(&scan_cond);
+         } else {
+            pthread_cond_wait(&scan_cond, &scan_mutex);
+            --scan_idle;
+         }
+      }
+      if (scan_done) {
+         pthread_mutex_unlock(&scan_mutex);
+         break;
+      }
+
+      // Leave some work for the others
+      size_t n = std::min((size_t)SCAN_BATCH, std::max((size_t)1, scan_top / scan_threads));
+      scan_top -= n;
+      memcpy(work, scan_stack + scan_top, n * sizeof *work);
+      pthread_mutex_unlock(&scan_mutex);
+
+      for (size_t i = 0; i < n; ++i) {
+         const Block *block = &blocks[work[i]];
+         _scan_words(block->lo, block->hi, batch, &count);
+      }
+
+      _scan_push(batch, count);
+      count = 0;
+   }
+
+   return NULL;
+}
+
+
+struct ReadableRange {
+   uintptr_t lo;
+   uintptr_t hi;
+};
+
+static ReadableRange *readable;
+static size_t numReadable;
+
+
+/**
+ * Collect the readable mappings from /proc/self/maps, so that roots are never
+ * scanned past what is actually mapped.
+ */
+static void
+_read_maps(void)
+{
+   int maps = open("/proc/self/maps", O_RDONLY);
+   if (maps < 0) {
+      return;
+   }
+
+   size_t capacity = 64*1024;
+   size_t length = 0;
+   char *text = (char *)__libc_malloc(capacity);
+   while (text) {
+      if (length + 1 == capacity) {
+         char *larger = (char *)__libc_malloc(capacity * 2);
+         if (larger) {
+            memcpy(larger, text, length);
+         }
+         __libc_free(text);
+         text = larger;
+         capacity *= 2;
+         continue;
+      }
+      ssize_t nread = read(maps, text + length, capacity - 1 - length);
+      if (nread <= 0) {
+         break;
+      }
+      length += nread;
+   }
+   close(maps);
+   if (!text) {
+      return;
+   }
+   text[length] = 0;
+
+   size_t lines = 0;
+   for (size_t i = 0; i < length; ++i) {
+      lines += text[i] == '\n';
+   }
+   readable = (ReadableRange *)__libc_malloc((lines + 1) * sizeof *readable);
+   if (readable) {
+      char *line = text;
+      while (*line) {
+         char *end;
+         uintptr_t lo = strtoull(line, &end, 16);
+         uintptr_t hi = *end == '-' ? strtoull(end + 1, &end, 16) : 0;
+         if (*end == ' ' && end[1] == 'r' && lo < hi) {
+            readable[numReadable].lo = lo;
+            readable[numReadable].hi = hi;
+            ++numReadable;
+         }
+         char *next = strchr(line, '\n');
+         if (!next) {
+            break;
+         }
+         line = next + 1;
+      }
+   }
+
+   __libc_free(text);
+}
+
+
+static void
+_scan_root(uintptr_t lo, uintptr_t hi, size_t *batch, size_t *count)
+{
+   for (size_t i = 0; i < numReadable; ++i) {
+      uintptr_t start = std::max(lo, readable[i].lo);
+      uintptr_t stop = std::min(hi, readable[i].hi);
+      if (start < stop) {
+         _scan_words(start, stop, batch, count);
+      }
+   }
+}
+
+
+struct RootScan {
+   size_t *batch;
+   size_t *count;
+};
+
+
+static int
+_scan_module(struct dl_phdr_info *info, size_t, void *data)
+{
+   RootScan *scan = (RootScan *)data;
+
+   // Skip our own bookkeeping
+   uintptr_t self = (uintptr_t)&scan_enabled;
+   for (unsigned i = 0; i < info->dlpi_phnum; ++i) {
+      const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+      if (phdr->p_type == PT_LOAD) {
+         uintptr_t lo = info->dlpi_addr + phdr->p_vaddr;
+         if (lo <= self && self < lo + phdr->p_memsz) {
+            return 0;
+         }
+      }
+   }
+
+   for (unsigned i = 0; i < info->dlpi_phnum; ++i) {
+      const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+      if (phdr->p_type == PT_LOAD && (phdr->p_flags & PF_W)) {
+         uintptr_t lo = info->dlpi_addr + phdr->p_vaddr;
+         _scan_root(lo, lo + phdr->p_memsz, scan->batch, scan->count);
+      }
+   }
+
+   return 0;
+}
+
+
+/**
+ * Mark every live block reachable from the roots, and log the unreachable
+ * ones.  Must be called with the mutex held, and the pending list flushed.
+ */
+static void
+_scan(void)
+{
+   scanning = true;
+
+   numBlocks = 0;
+   struct list_head *it;
+   for (it = live_list.next; it != &live_list; it = it->next) {
+      ++numBlocks;
+   }
+
+   blocks = (Block *)__libc_malloc((numBlocks + 1) * sizeof *blocks);
+   marks = (unsigned char *)__libc_malloc(numBlocks + 1);
+   scan_stack = (size_t *)__libc_malloc((numBlocks + 1) * sizeof *scan_stack);
+   if (!blocks || !marks || !scan_stack) {
+      fprintf(stderr, "memtrail: warning: not enough memory to scan\n");
+      __libc_free(scan_stack);
+      __libc_free(marks);
+      __libc_free(blocks);
+      scanning = false;
+      return;
+   }
+
+   size_t i = 0;
+   for (it = live_list.next; it != &live_list; it = it->next) {
+      struct header_t *hdr = LIST_ENTRY(struct header_t, it, live_head);
+      blocks[i].lo = (uintptr_t)_user_ptr(hdr);
+      blocks[i].hi = blocks[i].lo + hdr->size;
+      blocks[i].hdr = hdr;
+      ++i;
+   }
+   // Unlike qsort(), std::sort() does not allocate
+   std::sort(blocks, blocks + numBlocks, [](const Block &a, const Block &b) { return a.lo < b.lo; });
+   memset(marks, 0, numBlocks);
+
+   _read_maps();
+
+   // Roots.  Registers of the current thread are spilled to its stack by
+   // unw_getcontext(); those of other threads can't be, so their whole stacks
+   // are scanned instead.
+   size_t batch[SCAN_BATCH];
+   size_t count = 0;
+   unw_context_t uc;
+   unw_getcontext(&uc);
+   _scan_words((uintptr_t)&uc, (uintptr_t)(&uc + 1), batch, &count);
+
+   RootScan roots = { batch, &count };
+   dl_iterate_phdr(_scan_module, &roots);
+
+   uintptr_t sp = (uintptr_t)&uc;
+   for (unsigned t = 0; t < ARRAY_SIZE(thread_stacks); ++t) {
+      uintptr_t lo = (uintptr_t)thread_stacks[t].lo;
+      uintptr_t hi = (uintptr_t)thread_stacks[t].hi;
+      if (lo <= sp && sp < hi) {
+         lo = sp;
+      }
+      if (lo < hi) {
+         _scan_root(lo, hi, batch, &count);
+      }
+   }
+   _scan_push(batch, count);
+
+   // Mark phase
+   long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+   scan_threads = std::max(1L, std::min(cpus, (long)MAX_SCAN_THREADS));
+   scan_idle = 0;
+   scan_done = false;
+
+   pthread_t workers[MAX_SCAN_THREADS];
+   unsigned numWorkers = 0;
+   for (unsigned t = 1; t < scan_threads; ++t) {
+      if (pthread_create(&workers[numWorkers], NULL, _scan_worker, NULL) != 0) {
+         break;
+      }
+      ++numWorkers;
+   }
+   scan_threads = numWorkers + 1;
+   _scan_worker(NULL);
+   for (unsigned t = 0; t < numWorkers; ++t) {
+      pthread_join(workers[t], NULL);
+   }
+
+   // Log the unreachable blocks, in batches that fit a pipe buffer
+   size_t unreachable_size = 0;
+   size_t j = 0;
+   do {
+      const void *ptrs[SCAN_BATCH];
+      size_t n = 0;
+      while (j < numBlocks && n < ARRAY_SIZE(ptrs)) {
+         const struct header_t *hdr = blocks[j].hdr;
+         if (!marks[j] && !hdr->internal && !hdr->filtered && !hdr->untraced) {
+            ptrs[n++] = _user_ptr(hdr);
+            unreachable_size += hdr->size;
+         }
+         ++j;
+      }
+
+      if (!n) {
+         continue;
+      }
+
+      // The blocks are sorted, so the pointers are encoded as deltas
+      PipeBuf buf(fd);
+      buf.write_special(EVENT_UNREACHABLE);
+      buf.write_varint(n);
+      for (size_t k = 0; k < n; ++k) {
+         buf.write_pointer(ptrs[k]);
+      }
+   } while (j < numBlocks);
+
+   fprintf(stderr, "memtrail: unreachable %zi bytes\n", unreachable_size);
+
+   __libc_free(readable);
+   __libc_free(scan_stack);
+   __libc_free(marks);
+   __libc_free(blocks);
+
+   scanning = false;
+}
+
+
+/*
+ * Residency.
+ *
+ * Blocks of at least MEMTRAIL_RESIDENCY bytes are kept in the live list, so
+ * that which of their pages are actually resident can be sampled with
+ * mincore() at snapshots, at the peak, and at exit.
+ */
+
+static bool residency_enabled = false;
+static size_t residency_min_size = 0;
+static ssize_t residency_peak_size = 0;
+
+static unsigned char residency_vec[RESIDENCY_WINDOW];
+
+
+/**
+ * Bytes of [lo, hi) in resident pages.
+ */
+static size_t
+_resident_size(uintptr_t lo, uintptr_t hi)
+{
+   size_t resident = 0;
+   uintptr_t page = lo & ~(uintptr_t)(pagesize - 1);
+   while (page < hi) {
+      size_t pages = std::min((hi - page + pagesize - 1) / pagesize, (size_t)RESIDENCY_WINDOW);
+      if (mincore((void *)page, pages * pagesize, residency_vec) != 0) {
+         // Presume resident what can't be told apart
+         return resident + (hi - std::max(page, lo));
+      }
+      for (size_t i = 0; i < pages; ++i, page += pagesize) {
+         if (residency_vec[i] & 1) {
+            resident += std::min(page + pagesize, (uintptr_t)hi) - std::max(page, lo);
+         }
+      }
+   }
+   return resident;
+}
+
+
+/**
+ * Log the resident bytes of every large block.  Must be called with the mutex
+ * held, and the pending list flushed, so that all blocks were logged.
+ */
+static void
+_sample_residency(void)
+{
+   _open();
+
+   struct list_head *it = live_list.next;
+   while (it != &live_list) {
+      const void *ptrs[RESIDENCY_BATCH];
+      size_t sizes[RESIDENCY_BATCH];
+      size_t n = 0;
+      while (it != &live_list && n < ARRAY_SIZE(ptrs)) {
+         const struct header_t *hdr = LIST_ENTRY(struct header_t, it, live_head);
+         it = it->next;
+         if (hdr->size >= residency_min_size &&
+             !hdr->internal && !hdr->filtered && !hdr->untraced) {
+            uintptr_t lo = (uintptr_t)_user_ptr(hdr);
+            ptrs[n] = (const void *)lo;
+            sizes[n] = _resident_size(lo, lo + hdr->size);
+            ++n;
+         }
+      }
+
+      if (n) {
+         PipeBuf buf(fd);
+         buf.write_special(EVENT_RESIDENCY);
+         buf.write_varint(n);
+         for (size_t k = 0; k < n; ++k) {
+            buf.write_pointer(ptrs[k]);
+            buf.write_varint(sizes[k]);
+         }
+      }
+   }
+}
+
+
+static inline bool
+_size_filtered(size_t size)
+{
+   return size < filter_min_size || size > filter_max_size;
+}
+
+
+static inline void
+init(struct header_t *hdr,
+     size_t size,
+     void *ptr,
+     unw_context_t *uc,
+     const struct header_t *from = nullptr)
+{
+   hdr->ptr = ptr;
+   hdr->size = size;
+   hdr->allocated = true;
+   hdr->pending = nullptr;
+   hdr->custom = false;
+   hdr->live = false;
+   hdr->filtered = _size_filtered(size);
+   hdr->untraced = false;
+   hdr->detached = false;
+   hdr->compact = false;
+
+   // Presume allocations created by libstdc++ before we initialized are
+   // internal.  This is necessary to ignore its emergency_pool global.
+   hdr->internal = fd == -1 || scanning;
+
+   if (scan_enabled && !thread_registered) {
+      _register_thread();
+   }
+
+   hdr->tag = _current_tag();
+
+   if (from && !from->untraced && !from->compact) {
+      // Continue the realloc chain of the block this one replaces
+      hdr->realloc_steps = from->realloc_steps + 1;
+      hdr->realloc_copied = from->realloc_copied + std::min(from->size, size);
+      hdr->realloc_origin = from->realloc_steps ? from->realloc_origin : from->size;
+   } else {
+      hdr->realloc_steps = 0;
+      hdr->realloc_copied = 0;
+      hdr->realloc_origin = 0;
+   }
+
+   if (RECORD && uc && !hdr->filtered) {
+      uint64_t start = _cycles();
+      hdr->addr_count = libunwind_backtrace(uc, hdr->addrs, ARRAY_SIZE(hdr->addrs));
+      ThreadStats *thread = _thread_stats();
+      _stat_add(&thread->unwinds, 1);
+      _stat_add(&thread->frames, hdr->addr_count);
+      _stat_add(&thread->unwind_cycles, _cycles() - start);
+   } else {
+      hdr->addr_count = 0;
    }
 }
 
+
+/**
+ * Initialize just the last COMPACT_HEADER_SIZE bytes of the header of a block
+ * that is never logged, as it was allocated while tracing is stopped, or else
+ * is excluded by size.
+ */
 static inline void
-init(struct header_t *hdr,
-     size_t size,
-     void *ptr,
-     unw_context_t *uc)
+init_compact(struct header_t *hdr,
+             size_t size,
+             void *ptr,
+             bool untraced)
 {
    hdr->ptr = ptr;
    hdr->size = size;
    hdr->allocated = true;
-   hdr->pending = false;
+   hdr->internal = !untraced && fd == -1;
+   hdr->custom = false;
+   hdr->live = false;
+   hdr->filtered = !untraced;
+   hdr->untraced = untraced;
+   hdr->detached = false;
+   hdr->compact = true;
+}
 
-   // Presume allocations created by libstdc++ before we initialized are
-   // internal.  This is necessary to ignore its emergency_pool global.
-   hdr->internal = fd == -1;
 
-   if (RECORD) {
-      hdr->addr_count = libunwind_backtrace(uc, hdr->addrs, ARRAY_SIZE(hdr->addrs));
+/*
+ * Snapshots.
+ *
+ * Besides the explicit memtrail_snapshot() calls, snapshots can be triggered
+ * automatically, as set by MEMTRAIL_AUTO_SNAPSHOT's comma or newline
+ * separated rules:
+ *
+ *   watermark=SIZE        when the heap first grows past SIZE (repeatable)
+ *   growth=PERCENT        when the heap grew PERCENT since the last snapshot
+ *   interval=SECONDS      every SECONDS
+ *   min-interval=SECONDS  at most once every SECONDS (1 by default)
+ *
+ * SIZE may have a K, M, or G suffix.  To keep _update() cheap, it merely
+ * compares the heap size against the precomputed size of the next trigger,
+ * and counts down the updates until the clock is read again.
+ */
+
+#define MAX_WATERMARKS 16
+#define AUTO_SNAPSHOT_CHECK_PERIOD 4096 // updates between clock reads
+#define MIN_GROWTH_BASE (1 << 20) // so the first growth snapshots aren't tiny
+
+static size_t last_snapshot_size = 0;
+static unsigned snapshot_no = 0;
+
+static bool auto_snapshot = false;
+static ssize_t watermarks[MAX_WATERMARKS];
+static unsigned numWatermarks = 0;
+static unsigned nextWatermark = 0;
+static unsigned auto_snapshot_growth = 0; // percentage
+static uint64_t auto_snapshot_interval = 0; // nanoseconds
+static uint64_t auto_snapshot_min_interval = 1000000000ULL; // nanoseconds
+static uint64_t last_snapshot_time = 0;
+
+// Heap size at which to check the triggers next
+static ssize_t auto_snapshot_size = SSIZE_MAX;
+static unsigned auto_snapshot_countdown = AUTO_SNAPSHOT_CHECK_PERIOD;
+
+
+static inline uint64_t
+_now(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static size_t
+_parse_size(const char *value)
+{
+   char *end;
+   size_t size = strtoull(value, &end, 0);
+   switch (*end) {
+   case 'g':
+   case 'G':
+      size <<= 10;
+      // fall through
+   case 'm':
+   case 'M':
+      size <<= 10;
+      // fall through
+   case 'k':
+   case 'K':
+      size <<= 10;
+      break;
+   }
+   return size;
+}
+
+
+/**
+ * Compute the total size at which to check the automatic snapshot triggers
+ * before the countdown runs out.
+ */
+static void
+_arm_auto_snapshot(uint64_t now, ssize_t growth_size)
+{
+   if (now - last_snapshot_time < auto_snapshot_min_interval) {
+      // Rate limited, so leave it to the countdown
+      auto_snapshot_size = SSIZE_MAX;
+   } else {
+      auto_snapshot_size = growth_size;
+      if (nextWatermark < numWatermarks) {
+         auto_snapshot_size = std::min(auto_snapshot_size, watermarks[nextWatermark]);
+      }
+   }
+}
+
+
+static void
+_parse_auto_snapshot(const char *rules)
+{
+   while (*rules) {
+      size_t len = strcspn(rules, ",\n");
+      const char *value = (const char *)memchr(rules, '=', len);
+      if (value) {
+         size_t key_len = value - rules;
+         ++value;
+         if (key_len == 9 && strncmp(rules, "watermark", key_len) == 0) {
+            if (numWatermarks < MAX_WATERMARKS) {
+               // Keep them sorted
+               ssize_t watermark = (ssize_t)std::min(_parse_size(value), (size_t)SSIZE_MAX);
+               unsigned i = numWatermarks++;
+               for (; i > 0 && watermarks[i - 1] > watermark; --i) {
+                  watermarks[i] = watermarks[i - 1];
+               }
+               watermarks[i] = watermark;
+            } else {
+               fprintf(stderr, "memtrail: warning: ignoring snapshot rule %.*s\n", (int)len, rules);
+            }
+         } else if (key_len == 6 && strncmp(rules, "growth", key_len) == 0) {
+            auto_snapshot_growth = strtoul(value, NULL, 0);
+         } else if (key_len == 8 && strncmp(rules, "interval", key_len) == 0) {
+            auto_snapshot_interval = (uint64_t)(strtod(value, NULL) * 1e9);
+         } else if (key_len == 12 && strncmp(rules, "min-interval", key_len) == 0) {
+            auto_snapshot_min_interval = (uint64_t)(strtod(value, NULL) * 1e9);
+         } else {
+            fprintf(stderr, "memtrail: warning: unknown snapshot rule %.*s\n", (int)len, rules);
+         }
+      } else if (len) {
+         fprintf(stderr, "memtrail: warning: malformed snapshot rule %.*s\n", (int)len, rules);
+      }
+
+      rules += len;
+      if (*rules) {
+         ++rules;
+      }
+   }
+
+   auto_snapshot = numWatermarks || auto_snapshot_growth || auto_snapshot_interval;
+   last_snapshot_time = _now();
+
+   // Arm the watermarks now, rather than only after the first countdown
+   _arm_auto_snapshot(last_snapshot_time,
+                      auto_snapshot_growth ? MIN_GROWTH_BASE + MIN_GROWTH_BASE / 100 * auto_snapshot_growth : SSIZE_MAX);
+}
+
+
+/**
+ * Log a snapshot.  Must be called with the mutex held.
+ */
+static void
+_snapshot(const char *reason)
+{
+   _flush();
+
+   _open();
+
+   if (residency_enabled) {
+      _sample_residency();
+   }
+
+   PipeBuf buf(fd);
+   buf.write_special(EVENT_SNAPSHOT);
+   buf.flush();
+
+   ssize_t current_total_size;
+   ssize_t current_max_size;
+   logged_counter.get(&current_total_size, &current_max_size);
+   size_t current_delta_size;
+   if (snapshot_no)
+      current_delta_size = current_total_size - last_snapshot_size;
+   else
+      current_delta_size = 0;
+   last_snapshot_size = current_total_size;
+   last_snapshot_time = _now();
+
+   ++snapshot_no;
+
+   // Avoid stdio, as this may be reached from within malloc
+   char message[128];
+   int len = snprintf(message, sizeof message, "memtrail: snapshot %zi bytes (%+zi bytes)%s%s\n",
+                      current_total_size, current_delta_size,
+                      reason ? " on " : "", reason ? reason : "");
+   if (len > 0) {
+      ssize_t ret = ::write(STDERR_FILENO, message, std::min((size_t)len, sizeof message - 1));
+      (void)ret;
+   }
+}
+
+
+/**
+ * Check the automatic snapshot triggers, and compute when to check them next.
+ * Must be called with the mutex held.
+ */
+static void
+_auto_snapshot(void)
+{
+   uint64_t now = _now();
+   ssize_t total_size = logged_counter.estimate();
+
+   auto_snapshot_countdown = AUTO_SNAPSHOT_CHECK_PERIOD;
+
+   ssize_t growth_base = std::max(last_snapshot_size, (size_t)MIN_GROWTH_BASE);
+   ssize_t growth_size = auto_snapshot_growth ? growth_base + growth_base / 100 * auto_snapshot_growth : SSIZE_MAX;
+
+   if (now - last_snapshot_time >= auto_snapshot_min_interval) {
+      const char *reason = NULL;
+      if (nextWatermark < numWatermarks && total_size >= watermarks[nextWatermark]) {
+         reason = "watermark";
+         while (nextWatermark < numWatermarks && total_size >= watermarks[nextWatermark]) {
+            ++nextWatermark;
+         }
+      } else if (total_size >= growth_size) {
+         reason = "growth";
+      } else if (auto_snapshot_interval && now - last_snapshot_time >= auto_snapshot_interval) {
+         reason = "interval";
+      }
+
+      if (reason) {
+         _snapshot(reason);
+         growth_base = std::max(last_snapshot_size, (size_t)MIN_GROWTH_BASE);
+         growth_size = auto_snapshot_growth ? growth_base + growth_base / 100 * auto_snapshot_growth : SSIZE_MAX;
+      }
+   }
+
+   _arm_auto_snapshot(now, growth_size);
+}
+
+
+static void
+_parse_roll(const char *rules)
+{
+   while (*rules) {
+      size_t len = strcspn(rules, ",\n");
+      const char *value = (const char *)memchr(rules, '=', len);
+      if (value) {
+         size_t key_len = value - rules;
+         ++value;
+         if (key_len == 4 && strncmp(rules, "size", key_len) == 0) {
+            roll_size = _parse_size(value);
+         } else if (key_len == 8 && strncmp(rules, "interval", key_len) == 0) {
+            roll_interval = (uint64_t)(strtod(value, NULL) * 1e9);
+         } else {
+            fprintf(stderr, "memtrail: warning: unknown roll rule %.*s\n", (int)len, rules);
+         }
+      } else if (len) {
+         fprintf(stderr, "memtrail: warning: malformed roll rule %.*s\n", (int)len, rules);
+      }
+
+      rules += len;
+      if (*rules) {
+         ++rules;
+      }
+   }
+
+   rolling = roll_size != SIZE_MAX || roll_interval;
+   segment_start = _now();
+}
+
+
+/**
+ * Close the current segment, and start the next one.  Must be called with the
+ * mutex held.
+ */
+static void
+_rotate(void)
+{
+   _flush();
+
+   if (use_mmap) {
+      _mmap_close();
+   }
+   close(fd);
+
+   ++segment_no;
+   segment_start = _now();
+   _create();
+
+   // Segments must be decodable on their own
+   for (unsigned i = 0; i < numModules; ++i) {
+      modules[i].defined = false;
+   }
+   PipeBuf buf(fd);
+   for (unsigned short id = 1; id < numTags; ++id) {
+      _log_tag_name(buf, id);
+   }
+}
+
+
+/**
+ * Check the segment budget, and compute when to check it next.  Must be called
+ * with the mutex held.
+ */
+static void
+_roll(void)
+{
+   roll_countdown = ROLL_CHECK_PERIOD;
+
+   if (fd >= 0 &&
+       (segment_written >= roll_size ||
+        (roll_interval && _now() - segment_start >= roll_interval))) {
+      _rotate();
    }
 }
 
 
+/*
+ * Whether logged events may be queued without the mutex, which is only when
+ * nothing else needs to see them in order: scanning, residency sampling,
+ * memory mapped output, automatic snapshots, rolling, and module rules all
+ * keep them serialized.
+ */
+static bool queue_enabled = false;
+
+
+/**
+ * Queue the event of a logged block in a slot's list, without the mutex, if
+ * that can't reach a new maximum.  Below the maximum, events can't be at the
+ * peak either, so frees may cancel pending allocations without flushing.
+ */
+static inline bool
+_queue(struct header_t *hdr,
+       bool allocating)
+{
+   ssize_t size = allocating ? (ssize_t)hdr->size : -(ssize_t)hdr->size;
+
+   // Only the freeing thread may queue the block, but a flush may dequeue it
+   CounterSlot *slot = __atomic_load_n(&hdr->pending, __ATOMIC_RELAXED);
+   if (!slot) {
+      slot = logged_counter.slot(logged_slot);
+   }
+
+   ScalableCounter::lock(slot);
+   if (!logged_counter.tryAdd(slot, size)) {
+      ScalableCounter::unlock(slot);
+      return false;
+   }
+   hdr->allocated = allocating;
+   bool cancelled = hdr->pending == slot;
+   if (cancelled) {
+      assert(!allocating);
+      list_del(&hdr->list_head);
+      __atomic_store_n(&hdr->pending, nullptr, __ATOMIC_RELAXED);
+   } else {
+      list_addtail(&hdr->list_head, &slot->pending);
+      __atomic_store_n(&hdr->pending, slot, __ATOMIC_RELAXED);
+   }
+   ScalableCounter::unlock(slot);
+
+   if (cancelled) {
+      _release(hdr);
+   }
+
+   _stat_add(&_thread_stats()->events, 1);
+   return true;
+}
+
+
 /**
  * Update/log changes to memory allocations.
  */
@@ -564,66 +2877,410 @@ static inline void
 _update(struct header_t *hdr,
         bool allocating = true)
 {
-   pthread_mutex_lock(&mutex);
+   if (hdr->untraced && !scan_enabled) {
+      // Neither logged nor accounted, so there's nothing to serialize
+      hdr->allocated = allocating;
+      if (!allocating) {
+         _release(hdr);
+      }
+      return;
+   }
+
+   if (hdr->filtered && !hdr->internal && !scan_enabled) {
+      // Filtered allocations are never logged, so they needn't be serialized
+      ssize_t size = allocating ? (ssize_t)hdr->size : -(ssize_t)hdr->size;
+      if (size > 0 &&
+          logged_counter.estimate() + excluded_counter.estimate() + size > limit_size) {
+         fprintf(stderr, "memtrail: warning: out of memory\n");
+         pthread_mutex_lock(&mutex);
+         _flush();
+         _exit(1);
+      }
+      excluded_counter.update(excluded_slot, size);
+      hdr->allocated = allocating;
+      if (!allocating) {
+         _release(hdr);
+      }
+      return;
+   }
+
+   if (queue_enabled && !flushing &&
+       !hdr->internal && !hdr->filtered && !hdr->untraced &&
+       (allocating || !hdr->realloc_steps) &&
+       _queue(hdr, allocating)) {
+      return;
+   }
+
+   if (pthread_mutex_trylock(&mutex) != 0) {
+      uint64_t start = _cycles();
+      pthread_mutex_lock(&mutex);
+      ThreadStats *thread = _thread_stats();
+      _stat_add(&thread->lock_waits, 1);
+      _stat_add(&thread->lock_wait_cycles, _cycles() - start);
+   }
 
    static int recursion = 0;
 
    if (recursion++ <= 0) {
-      if (!allocating && max_size == total_size) {
+      if (allocating && !hdr->internal && !hdr->filtered && !hdr->untraced &&
+          (numIncludeModules || numExcludeModules) &&
+          !_filter_stack(hdr)) {
+         hdr->filtered = true;
+      }
+
+      if (!allocating && !hdr->filtered && !hdr->untraced && logged_counter.atPeak()) {
          _flush();
+         ssize_t max_size = logged_counter.max();
+         if (residency_enabled && max_size >= residency_peak_size) {
+            _sample_residency();
+            residency_peak_size = max_size + max_size / RESIDENCY_PEAK_GROWTH;
+         }
+      }
+
+      if (!allocating && !hdr->filtered && !hdr->untraced && !hdr->internal && hdr->realloc_steps &&
+          !use_mmap) {
+         _open();
+         PipeBuf buf(fd);
+         _log_realloc_chain(buf, hdr);
+      }
+
+      if (!hdr->filtered && !hdr->untraced && !hdr->internal) {
+         _stat_add(&_thread_stats()->events, 1);
       }
 
       hdr->allocated = allocating;
       ssize_t size = allocating ? (ssize_t)hdr->size : -(ssize_t)hdr->size;
 
       bool internal = hdr->internal;
-      if (hdr->pending) {
+      bool filtered = hdr->filtered;
+      bool untraced = hdr->untraced;
+      // Blocks that are never logged needn't be sampled, and must not be
+      // kept in the list, as filtered ones are freed without the mutex
+      if ((scan_enabled ||
+           (residency_enabled && hdr->size >= residency_min_size && !filtered && !untraced)) &&
+          !hdr->custom) {
+         if (allocating) {
+            hdr->live = true;
+            list_addtail(&hdr->live_head, &live_list);
+         } else if (hdr->live) {
+            hdr->live = false;
+            list_del(&hdr->live_head);
+         }
+      }
+      if (filtered || untraced) {
+         // Never logged, so there's no need to hold it
+         if (!allocating) {
+            _release(hdr);
+            hdr = nullptr;
+         }
+      } else if (use_mmap) {
+         if (!internal) {
+            // Commit the realloc chain along with the free, as one chunk
+            _open();
+            PipeBuf buf(fd);
+            if (!allocating && hdr->realloc_steps) {
+               _log_realloc_chain(buf, hdr);
+            }
+            _log(buf, hdr);
+         }
+         if (!allocating) {
+            _release(hdr);
+            hdr = nullptr;
+         }
+      } else if (hdr->pending) {
+         // Flushes only happen with the mutex held, so it's still pending
          assert(!allocating);
-         hdr->pending = false;
+         CounterSlot *slot = hdr->pending;
+         ScalableCounter::lock(slot);
          list_del(&hdr->list_head);
-         __libc_free(hdr->ptr);
+         hdr->pending = nullptr;
+         ScalableCounter::unlock(slot);
+         _release(hdr);
          hdr = nullptr;
       } else {
-         hdr->pending = true;
-         list_add(&hdr->list_head, &hdr_list);
+         CounterSlot *slot = logged_counter.slot(logged_slot);
+         ScalableCounter::lock(slot);
+         list_addtail(&hdr->list_head, &slot->pending);
+         hdr->pending = slot;
+         ScalableCounter::unlock(slot);
       }
 
-      if (!internal) {
+      if (!internal && !untraced) {
+         ssize_t total_size = logged_counter.estimate();
          if (size > 0 &&
              (total_size + size < total_size || // overflow
-              total_size + size > limit_size)) {
+              total_size + excluded_counter.estimate() + size > limit_size)) {
             fprintf(stderr, "memtrail: warning: out of memory\n");
             _flush();
             _exit(1);
          }
 
-         total_size += size;
-         assert(total_size >= 0);
+         if (filtered) {
+            excluded_counter.update(excluded_slot, size);
+         } else {
+            logged_counter.add(size);
+         }
+      }
+
+      if (auto_snapshot &&
+          (logged_counter.estimate() >= auto_snapshot_size || --auto_snapshot_countdown == 0)) {
+         _auto_snapshot();
+      }
+
+      if (rolling &&
+          (segment_written >= roll_size || --roll_countdown == 0)) {
+         _roll();
+      }
+   } else {
+      fprintf(stderr, "memtrail: warning: recursion\n");
+      hdr->internal = true;
+
+      assert(hdr->compact || !hdr->pending);
+      if (hdr->compact || !hdr->pending) {
+         if (!allocating) {
+            if (hdr->live) {
+               hdr->live = false;
+               list_del(&hdr->live_head);
+            }
+            _release(hdr);
+            hdr = nullptr;
+         }
+      }
+   }
+   --recursion;
+
+   pthread_mutex_unlock(&mutex);
+}
+
+
+/*
+ * Side table.
+ *
+ * With MEMTRAIL_SIDE_TABLE set, headers are separate blocks, found through a
+ * hash table keyed by the address handed out to the application, which is
+ * exactly what __libc_malloc() or __libc_memalign() returned.  This keeps
+ * malloc_usable_size(), alignment padding, and cache line placement as
+ * they'd be without memtrail.
+ *
+ * The table is split into shards, each behind its own spin lock, so that
+ * threads allocating and freeing concurrently seldom contend.  Blocks
+ * allocated while tracing is stopped get no header at all, unless they must
+ * be scanned, so they aren't in the table either.
+ */
+
+
+/**
+ * Open-addressing hash table, mapping addresses to their headers.
+ *
+ * Not thread-safe, so it must be protected by a lock.  Storage comes
+ * straight from __libc_malloc to avoid recursion.
+ */
+class PointerMap
+{
+protected:
+   struct Entry {
+      const void *key;
+      struct header_t *value;
+   };
+
+   Entry *_entries;
+   size_t _mask;
+   size_t _count;
+
+   inline size_t
+   _find(const void *key) const {
+      size_t i = hash(key) & _mask;
+      while (_entries[i].key && _entries[i].key != key) {
+         i = (i + 1) & _mask;
+      }
+      return i;
+   }
+
+   void
+   _grow(void) {
+      Entry *old_entries = _entries;
+      size_t old_capacity = _entries ? _mask + 1 : 0;
+
+      size_t capacity = old_capacity ? 2 * old_capacity : 1024;
+      _entries = (Entry *)__libc_malloc(capacity * sizeof *_entries);
+      if (!_entries) {
+         fprintf(stderr, "memtrail: error: out of memory\n");
+         abort();
+      }
+      memset(_entries, 0, capacity * sizeof *_entries);
+      _mask = capacity - 1;
+
+      for (size_t i = 0; i < old_capacity; ++i) {
+         if (old_entries[i].key) {
+            _entries[_find(old_entries[i].key)] = old_entries[i];
+         }
+      }
+      __libc_free(old_entries);
+   }
+
+public:
+   static inline size_t
+   hash(const void *key) {
+      uint64_t h = (uintptr_t)key;
+      h ^= h >> 33;
+      h *= 0xff51afd7ed558ccdULL;
+      h ^= h >> 33;
+      return h;
+   }
+
+   // Constant initialized, as the side table is used before constructors run
+   constexpr
+   PointerMap(void) :
+      _entries(nullptr),
+      _mask(0),
+      _count(0)
+   {
+   }
+
+   bool
+   insert(const void *key, struct header_t *value) {
+      assert(key);
+      if (4 * (_count + 1) > 3 * (_mask + 1)) {
+         _grow();
+      }
+      size_t i = _find(key);
+      if (_entries[i].key) {
+         return false;
+      }
+      _entries[i].key = key;
+      _entries[i].value = value;
+      ++_count;
+      return true;
+   }
+
+   struct header_t *
+   find(const void *key) const {
+      if (!_entries) {
+         return nullptr;
+      }
+      return _entries[_find(key)].value;
+   }
+
+   struct header_t *
+   remove(const void *key) {
+      if (!_entries) {
+         return nullptr;
+      }
+      size_t i = _find(key);
+      if (!_entries[i].key) {
+         return nullptr;
+      }
+      struct header_t *value = _entries[i].value;
+      --_count;
+
+      // Backward shift deletion, so that no tombstones are needed
+      size_t j = i;
+      while (true) {
+         j = (j + 1) & _mask;
+         if (!_entries[j].key) {
+            break;
+         }
+         size_t k = hash(_entries[j].key) & _mask;
+         if (i <= j ? (i < k && k <= j) : (i < k || k <= j)) {
+            continue;
+         }
+         _entries[i] = _entries[j];
+         i = j;
+      }
+      _entries[i].key = nullptr;
+
+      return value;
+   }
+};
+
+
+
+class SideTable
+{
+protected:
+   struct Shard {
+      int lock = 0;
+      PointerMap map;
+   } __attribute__((aligned(CACHE_LINE_SIZE)));
+
+   Shard _shards[1 << SIDE_TABLE_SHARD_BITS];
+
+   // The top bits pick the shard, and the bottom ones the slot within it
+   inline Shard *
+   _shard(const void *key) {
+      return &_shards[PointerMap::hash(key) >> (64 - SIDE_TABLE_SHARD_BITS)];
+   }
 
-         if (total_size >= max_size) {
-            max_size = total_size;
+   static inline void
+   _lock(Shard *shard) {
+      while (__atomic_exchange_n(&shard->lock, 1, __ATOMIC_ACQUIRE)) {
+         while (__atomic_load_n(&shard->lock, __ATOMIC_RELAXED)) {
+            _cpu_relax();
          }
       }
-   } else {
-      fprintf(stderr, "memtrail: warning: recursion\n");
-      hdr->internal = true;
+   }
 
-      assert(!hdr->pending);
-      if (!hdr->pending) {
-         if (!allocating) {
-            __libc_free(hdr->ptr);
-            hdr = nullptr;
-         }
-      }
+   static inline void
+   _unlock(Shard *shard) {
+      __atomic_store_n(&shard->lock, 0, __ATOMIC_RELEASE);
    }
-   --recursion;
 
-   pthread_mutex_unlock(&mutex);
+public:
+   void
+   insert(const void *key, struct header_t *value) {
+      Shard *shard = _shard(key);
+      _lock(shard);
+      bool inserted = shard->map.insert(key, value);
+      _unlock(shard);
+      assert(inserted);
+      (void)inserted;
+   }
+
+   struct header_t *
+   find(const void *key) {
+      Shard *shard = _shard(key);
+      _lock(shard);
+      struct header_t *value = shard->map.find(key);
+      _unlock(shard);
+      return value;
+   }
+
+   struct header_t *
+   remove(const void *key) {
+      Shard *shard = _shard(key);
+      _lock(shard);
+      struct header_t *value = shard->map.remove(key);
+      _unlock(shard);
+      return value;
+   }
+};
+
+
+static SideTable side_table;
+
+
+/**
+ * Whether headers are kept in the side table.  Decided on the first call,
+ * which precedes on_start(), so that every block has the same layout.
+ */
+static int side_table_enabled = -1;
+
+static inline bool
+_side_table(void)
+{
+   int enabled = __atomic_load_n(&side_table_enabled, __ATOMIC_RELAXED);
+   if (enabled < 0) {
+      const char *env = getenv("MEMTRAIL_SIDE_TABLE");
+      enabled = env && atoi(env);
+      __atomic_store_n(&side_table_enabled, enabled, __ATOMIC_RELAXED);
+   }
+   return enabled;
 }
 
 
 static void *
-_memalign(size_t alignment, size_t size, unw_context_t *uc)
+_memalign(size_t alignment, size_t size, unw_context_t *uc,
+          const struct header_t *from = nullptr)
 {
    void *ptr;
    struct header_t *hdr;
@@ -639,14 +3296,60 @@ _memalign(size_t alignment, size_t size, unw_context_t *uc)
       ++size;
    }
 
-   ptr = __libc_malloc(alignment + sizeof *hdr + size);
+   bool untraced = _paused();
+
+   if (_side_table()) {
+      if (alignment <= MIN_ALIGN) {
+         ptr = __libc_malloc(size);
+      } else {
+         ptr = __libc_memalign(alignment, size);
+      }
+      if (!ptr) {
+         return NULL;
+      }
+
+      // While tracing is stopped, blocks need no header, unless they must be
+      // kept in the live list to be scanned
+      if (untraced && !scan_enabled) {
+         return ptr;
+      }
+
+      hdr = (struct header_t *)__libc_malloc(sizeof *hdr);
+      if (!hdr) {
+         __libc_free(ptr);
+         return NULL;
+      }
+
+      init(hdr, size, ptr, uc, from);
+      hdr->untraced = untraced;
+      hdr->detached = true;
+      if (VERBOSITY >= 1) fprintf(stderr, "alloc %p %zu\n", ptr, size);
+
+      side_table.insert(ptr, hdr);
+      _update(hdr);
+
+      return ptr;
+   }
+
+   // Blocks that are never logged only need the tail of the header, unless
+   // they must be kept in the live list to be scanned, and blocks without a
+   // call stack don't need room for one
+   bool compact = (untraced || _size_filtered(size)) && !scan_enabled;
+   size_t header_size = compact ? COMPACT_HEADER_SIZE : uc ? sizeof *hdr : STACKLESS_HEADER_SIZE;
+
+   ptr = __libc_malloc(alignment + header_size + size);
    if (!ptr) {
       return NULL;
    }
 
-   hdr = (struct header_t *)((((size_t)ptr + sizeof *hdr + alignment - 1) & ~(alignment - 1)) - sizeof *hdr);
+   hdr = (struct header_t *)((((size_t)ptr + header_size + alignment - 1) & ~(alignment - 1)) - sizeof *hdr);
 
-   init(hdr, size, ptr, uc);
+   if (compact) {
+      init_compact(hdr, size, ptr, untraced);
+   } else {
+      init(hdr, size, ptr, uc, from);
+      hdr->untraced = untraced;
+   }
    res = &hdr[1];
    assert(((size_t)res & (alignment - 1)) == 0);
    if (VERBOSITY >= 1) fprintf(stderr, "alloc %p %zu\n", res, size);
@@ -672,13 +3375,60 @@ _free(void *ptr)
       return;
    }
 
-   hdr = (struct header_t *)ptr - 1;
+   if (_side_table()) {
+      hdr = side_table.remove(ptr);
+      if (!hdr) {
+         // Allocated while tracing was stopped
+         __libc_free(ptr);
+         return;
+      }
+   } else {
+      hdr = (struct header_t *)ptr - 1;
+   }
 
    if (VERBOSITY >= 1) fprintf(stderr, "free %p %zu\n", ptr, hdr->size);
 
    _update(hdr, false);
 }
 
+static void *
+_realloc(void *ptr, size_t size, unw_context_t *uc)
+{
+   struct header_t *hdr;
+   void *new_ptr;
+
+   if (!ptr) {
+      return _malloc(size, uc);
+   }
+
+   if (!size) {
+      _free(ptr);
+      return NULL;
+   }
+
+   if (_side_table()) {
+      hdr = side_table.find(ptr);
+   } else {
+      hdr = (struct header_t *)ptr - 1;
+   }
+
+   new_ptr = _memalign(MIN_ALIGN, size, uc, hdr);
+   if (new_ptr) {
+      // Blocks without a header are only known to the allocator
+      size_t old_size = hdr ? hdr->size : malloc_usable_size(ptr);
+      size_t min_size = old_size >= size ? size : old_size;
+      memcpy(new_ptr, ptr, min_size);
+
+      // The chain carries on in the new block
+      if (hdr && !hdr->compact) {
+         hdr->realloc_steps = 0;
+      }
+      _free(ptr);
+   }
+
+   return new_ptr;
+}
+
 
 /*
  * C
@@ -695,9 +3445,8 @@ posix_memalign(void **memptr, size_t alignment, size_t size)
       return EINVAL;
    }
 
-   unw_context_t uc;
-   unw_getcontext(&uc);
-   *memptr =  _memalign(alignment, size, &uc);
+   GETCONTEXT(uc);
+   *memptr =  _memalign(alignment, size, uc);
    if (!*memptr) {
       return -ENOMEM;
    }
@@ -709,46 +3458,41 @@ extern "C"
 PUBLIC void *
 memalign(size_t alignment, size_t size)
 {
-   unw_context_t uc;
-   unw_getcontext(&uc);
-   return _memalign(alignment, size, &uc);
+   GETCONTEXT(uc);
+   return _memalign(alignment, size, uc);
 }
 
 extern "C"
 PUBLIC void *
 aligned_alloc(size_t alignment, size_t size)
 {
-   unw_context_t uc;
-   unw_getcontext(&uc);
-   return _memalign(alignment, size, &uc);
+   GETCONTEXT(uc);
+   return _memalign(alignment, size, uc);
 }
 
 extern "C"
 PUBLIC void *
 valloc(size_t size)
 {
-   unw_context_t uc;
-   unw_getcontext(&uc);
-   return _memalign(sysconf(_SC_PAGESIZE), size, &uc);
+   GETCONTEXT(uc);
+   return _memalign(sysconf(_SC_PAGESIZE), size, uc);
 }
 
 extern "C"
 PUBLIC void *
 pvalloc(size_t size)
 {
-   unw_context_t uc;
-   unw_getcontext(&uc);
+   GETCONTEXT(uc);
    size_t pagesize = sysconf(_SC_PAGESIZE);
-   return _memalign(pagesize, (size + pagesize - 1) & ~(pagesize - 1), &uc);
+   return _memalign(pagesize, (size + pagesize - 1) & ~(pagesize - 1), uc);
 }
 
 extern "C"
 PUBLIC void *
 malloc(size_t size)
 {
-   unw_context_t uc;
-   unw_getcontext(&uc);
-   return _malloc(size, &uc);
+   GETCONTEXT(uc);
+   return _malloc(size, uc);
 }
 
 extern "C"
@@ -764,11 +3508,15 @@ PUBLIC void *
 calloc(size_t nmemb, size_t size)
 {
    void *ptr;
-   unw_context_t uc;
-   unw_getcontext(&uc);
-   ptr = _malloc(nmemb * size, &uc);
+   GETCONTEXT(uc);
+   ptr = _malloc(nmemb * size, uc);
    if (ptr) {
-      memset(ptr, 0, nmemb * size);
+      // Like glibc, don't touch fresh mmapped chunks, so that their pages
+      // don't become resident before the application uses them
+      const void *chunk = _side_table() ? ptr : ((const struct header_t *)ptr - 1)->ptr;
+      if (!mmapped_zeroed || !_chunk_is_mmapped(chunk)) {
+         memset(ptr, 0, nmemb * size);
+      }
    }
    return ptr;
 }
@@ -786,31 +3534,9 @@ extern "C"
 PUBLIC void *
 realloc(void *ptr, size_t size)
 {
-   struct header_t *hdr;
-   void *new_ptr;
-
-   unw_context_t uc;
-   unw_getcontext(&uc);
-
-   if (!ptr) {
-      return _malloc(size, &uc);
-   }
-
-   if (!size) {
-      _free(ptr);
-      return NULL;
-   }
-
-   hdr = (struct header_t *)ptr - 1;
-
-   new_ptr = _malloc(size, &uc);
-   if (new_ptr) {
-      size_t min_size = hdr->size >= size ? size : hdr->size;
-      memcpy(new_ptr, ptr, min_size);
-      _free(ptr);
-   }
+   GETCONTEXT(uc);
 
-   return new_ptr;
+   return _realloc(ptr, size, uc);
 }
 
 
@@ -818,11 +3544,7 @@ extern "C"
 PUBLIC void *
 reallocarray(void *ptr, size_t nmemb, size_t size)
 {
-   struct header_t *hdr;
-   void *new_ptr;
-
-   unw_context_t uc;
-   unw_getcontext(&uc);
+   GETCONTEXT(uc);
 
    if (nmemb && size) {
       size_t _size = nmemb * size;
@@ -834,25 +3556,7 @@ reallocarray(void *ptr, size_t nmemb, size_t size)
       size = 0;
    }
 
-   if (!ptr) {
-      return _malloc(size, &uc);
-   }
-
-   if (!size) {
-      _free(ptr);
-      return NULL;
-   }
-
-   hdr = (struct header_t *)ptr - 1;
-
-   new_ptr = _malloc(size, &uc);
-   if (new_ptr) {
-      size_t min_size = hdr->size >= size ? size : hdr->size;
-      memcpy(new_ptr, ptr, min_size);
-      _free(ptr);
-   }
-
-   return new_ptr;
+   return _realloc(ptr, size, uc);
 }
 
 
@@ -861,9 +3565,8 @@ PUBLIC char *
 strdup(const char *s)
 {
    size_t size = strlen(s) + 1;
-   unw_context_t uc;
-   unw_getcontext(&uc);
-   char *ptr = (char *)_malloc(size, &uc);
+   GETCONTEXT(uc);
+   char *ptr = (char *)_malloc(size, uc);
    if (ptr) {
       memcpy(ptr, s, size);
    }
@@ -881,9 +3584,8 @@ strndup(const char *s, size_t n)
       --n;
    }
 
-   unw_context_t uc;
-   unw_getcontext(&uc);
-   char *ptr = (char *)_malloc(len + 1, &uc);
+   GETCONTEXT(uc);
+   char *ptr = (char *)_malloc(len + 1, uc);
    if (ptr) {
       memcpy(ptr, s, len);
       ptr[len] = 0;
@@ -920,21 +3622,19 @@ extern "C"
 PUBLIC int
 vasprintf(char **strp, const char *fmt, va_list ap)
 {
-   unw_context_t uc;
-   unw_getcontext(&uc);
-   return _vasprintf(strp, fmt, ap, &uc);
+   GETCONTEXT(uc);
+   return _vasprintf(strp, fmt, ap, uc);
 }
 
 extern "C"
 PUBLIC int
 asprintf(char **strp, const char *format, ...)
 {
-   unw_context_t uc;
-   unw_getcontext(&uc);
+   GETCONTEXT(uc);
    int res;
    va_list ap;
    va_start(ap, format);
-   res = _vasprintf(strp, format, ap, &uc);
+   res = _vasprintf(strp, format, ap, uc);
    va_end(ap);
    return res;
 }
@@ -950,17 +3650,15 @@ asprintf(char **strp, const char *format, ...)
 
 PUBLIC void *
 operator new(size_t size) noexcept(false) {
-   unw_context_t uc;
-   unw_getcontext(&uc);
-   return _malloc(size, &uc);
+   GETCONTEXT(uc);
+   return _malloc(size, uc);
 }
 
 
 PUBLIC void *
 operator new[] (size_t size) noexcept(false) {
-   unw_context_t uc;
-   unw_getcontext(&uc);
-   return _malloc(size, &uc);
+   GETCONTEXT(uc);
+   return _malloc(size, uc);
 }
 
 
@@ -978,17 +3676,15 @@ operator delete[] (void *ptr) noexcept {
 
 PUBLIC void *
 operator new(size_t size, const std::nothrow_t&) noexcept {
-   unw_context_t uc;
-   unw_getcontext(&uc);
-   return _malloc(size, &uc);
+   GETCONTEXT(uc);
+   return _malloc(size, uc);
 }
 
 
 PUBLIC void *
 operator new[] (size_t size, const std::nothrow_t&) noexcept {
-   unw_context_t uc;
-   unw_getcontext(&uc);
-   return _malloc(size, &uc);
+   GETCONTEXT(uc);
+   return _malloc(size, uc);
 }
 
 
@@ -1006,56 +3702,52 @@ operator delete[] (void *ptr, const std::nothrow_t&) noexcept {
 
 PUBLIC void *
 operator new(size_t size, std::align_val_t al) noexcept(false) {
-   unw_context_t uc;
-   unw_getcontext(&uc);
-   return _memalign(static_cast<size_t>(al), size, &uc);
+   GETCONTEXT(uc);
+   return _memalign(static_cast<size_t>(al), size, uc);
 }
 
 
 PUBLIC void *
 operator new[] (size_t size, std::align_val_t al) noexcept(false) {
-   unw_context_t uc;
-   unw_getcontext(&uc);
-   return _memalign(static_cast<size_t>(al), size, &uc);
+   GETCONTEXT(uc);
+   return _memalign(static_cast<size_t>(al), size, uc);
 }
 
 
 PUBLIC void
-operator delete (void *ptr, std::align_val_t al) noexcept {
+operator delete (void *ptr, std::align_val_t) noexcept {
    _free(ptr);
 }
 
 
 PUBLIC void
-operator delete[] (void *ptr, std::align_val_t al) noexcept {
+operator delete[] (void *ptr, std::align_val_t) noexcept {
    _free(ptr);
 }
 
 
 PUBLIC void *
 operator new(size_t size, std::align_val_t al, const std::nothrow_t&) noexcept {
-   unw_context_t uc;
-   unw_getcontext(&uc);
-   return _memalign(static_cast<size_t>(al), size, &uc);
+   GETCONTEXT(uc);
+   return _memalign(static_cast<size_t>(al), size, uc);
 }
 
 
 PUBLIC void *
 operator new[] (size_t size, std::align_val_t al, const std::nothrow_t&) noexcept {
-   unw_context_t uc;
-   unw_getcontext(&uc);
-   return _memalign(static_cast<size_t>(al), size, &uc);
+   GETCONTEXT(uc);
+   return _memalign(static_cast<size_t>(al), size, uc);
 }
 
 
 PUBLIC void
-operator delete (void *ptr, std::align_val_t al, const std::nothrow_t&) noexcept {
+operator delete (void *ptr, std::align_val_t, const std::nothrow_t&) noexcept {
    _free(ptr);
 }
 
 
 PUBLIC void
-operator delete[] (void *ptr, std::align_val_t al, const std::nothrow_t&) noexcept {
+operator delete[] (void *ptr, std::align_val_t, const std::nothrow_t&) noexcept {
    _free(ptr);
 }
 
@@ -1065,37 +3757,124 @@ operator delete[] (void *ptr, std::align_val_t al, const std::nothrow_t&) noexce
  */
 
 
-static size_t last_snapshot_size = 0;
-static unsigned snapshot_no = 0;
-
 extern "C"
 PUBLIC void
 memtrail_snapshot(void) {
    pthread_mutex_lock(&mutex);
+   _snapshot(NULL);
+   pthread_mutex_unlock(&mutex);
+}
 
-   _flush();
 
-   _open();
+/*
+ * Start/stop.
+ */
 
-   static const void *ptr = NULL;
-   static const ssize_t size = 0;
-   PipeBuf buf(fd);
-   buf.write(&ptr, sizeof ptr);
-   buf.write(&size, sizeof size);
 
-   size_t current_total_size = total_size;
-   size_t current_delta_size;
-   if (snapshot_no)
-      current_delta_size = current_total_size - last_snapshot_size;
-   else
-      current_delta_size = 0;
-   last_snapshot_size = current_total_size;
+extern "C"
+PUBLIC void
+memtrail_start(void) {
+   __atomic_store_n(&paused, false, __ATOMIC_RELAXED);
+}
 
-   ++snapshot_no;
 
+extern "C"
+PUBLIC void
+memtrail_stop(void) {
+   __atomic_store_n(&paused, true, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Custom allocators.
+ */
+
+
+static PointerMap custom_map;
+
+
+extern "C"
+PUBLIC void
+memtrail_alloc_event(const void *ptr, size_t size) {
+   if (!ptr) {
+      return;
+   }
+
+   GETCONTEXT(uc);
+
+   struct header_t *hdr = (struct header_t *)__libc_malloc(sizeof *hdr);
+   if (!hdr) {
+      return;
+   }
+
+   init(hdr, size ? size : 1, (void *)ptr, uc);
+   hdr->custom = true;
+   hdr->untraced = _paused();
+   if (VERBOSITY >= 1) fprintf(stderr, "alloc event %p %zu\n", ptr, hdr->size);
+
+   pthread_mutex_lock(&mutex);
+   if (custom_map.insert(ptr, hdr)) {
+      _update(hdr);
+   } else {
+      fprintf(stderr, "memtrail: warning: duplicate allocation event for %p\n", ptr);
+      __libc_free(hdr);
+   }
+   pthread_mutex_unlock(&mutex);
+}
+
+
+extern "C"
+PUBLIC void
+memtrail_free_event(const void *ptr) {
+   if (!ptr) {
+      return;
+   }
+
+   pthread_mutex_lock(&mutex);
+   struct header_t *hdr = custom_map.remove(ptr);
+   if (hdr) {
+      if (VERBOSITY >= 1) fprintf(stderr, "free event %p %zu\n", ptr, hdr->size);
+      _update(hdr, false);
+   } else {
+      fprintf(stderr, "memtrail: warning: free event for unknown %p\n", ptr);
+   }
    pthread_mutex_unlock(&mutex);
+}
+
+
+/*
+ * Allocation tags.
+ */
+
+extern "C"
+PUBLIC void
+memtrail_tag_push(const char *name) {
+   unsigned short id = 0;
+   if (name) {
+      id = _cached_tag_id(name);
+      if (!id) {
+         pthread_mutex_lock(&mutex);
+         id = _tag_id(name);
+         pthread_mutex_unlock(&mutex);
+      }
+   }
+
+   unsigned depth = tag_depth;
+   if (depth < MAX_TAG_DEPTH) {
+      tag_stack[depth] = id;
+   }
+   tag_depth = depth + 1;
+}
 
-   fprintf(stderr, "memtrail: snapshot %zi bytes (%+zi bytes)\n", current_total_size, current_delta_size);
+
+extern "C"
+PUBLIC void
+memtrail_tag_pop(void) {
+   if (tag_depth) {
+      --tag_depth;
+   } else {
+      fprintf(stderr, "memtrail: warning: unbalanced tag pop\n");
+   }
 }
 
 
@@ -1113,6 +3892,55 @@ on_start(void)
    // Only trace the current process.
    unsetenv("LD_PRELOAD");
 
+   const char *tags_only = getenv("MEMTRAIL_TAGS_ONLY");
+   if (tags_only && atoi(tags_only)) {
+      record_stacks = false;
+   }
+
+   const char *filter = getenv("MEMTRAIL_FILTER");
+   if (filter) {
+      _parse_filter(filter);
+   }
+
+   const char *auto_snapshot_env = getenv("MEMTRAIL_AUTO_SNAPSHOT");
+   if (auto_snapshot_env) {
+      _parse_auto_snapshot(auto_snapshot_env);
+   }
+
+   const char *scan_env = getenv("MEMTRAIL_SCAN");
+   if (scan_env && atoi(scan_env)) {
+      scan_enabled = true;
+      pthread_key_create(&thread_key, _unregister_thread);
+      _register_thread();
+   }
+
+   const char *mmap_env = getenv("MEMTRAIL_MMAP");
+   if (mmap_env && atoi(mmap_env)) {
+      use_mmap = true;
+   }
+
+   const char *roll_env = getenv("MEMTRAIL_ROLL");
+   if (roll_env) {
+      _parse_roll(roll_env);
+   }
+
+   const char *residency_env = getenv("MEMTRAIL_RESIDENCY");
+   if (residency_env) {
+      residency_enabled = true;
+      residency_min_size = std::max(_parse_size(residency_env), (size_t)1);
+   }
+
+   const char *tunables = getenv("GLIBC_TUNABLES");
+   mmapped_zeroed = !getenv("MALLOC_PERTURB_") && !(tunables && strstr(tunables, "perturb"));
+
+   start_ns = _monotonic_ns();
+   start_cycles = _cycles();
+
+   const char *paused_env = getenv("MEMTRAIL_START_PAUSED");
+   if (paused_env && atoi(paused_env)) {
+      paused = true;
+   }
+
    _IO_doallocbuf(stdin);
    _IO_doallocbuf(stdout);
    _IO_doallocbuf(stderr);
@@ -1123,10 +3951,15 @@ on_start(void)
 
    // Abort when the application allocates half of the physical memory, to
    // prevent the system from slowing down to a halt due to swapping
-   long pagesize = sysconf(_SC_PAGESIZE);
+   pagesize = sysconf(_SC_PAGESIZE);
    long phys_pages = sysconf(_SC_PHYS_PAGES);
-   limit_size = (ssize_t) std::min((intmax_t) phys_pages / 2, SSIZE_MAX / pagesize) * pagesize;
+   limit_size = (ssize_t) std::min((intmax_t) phys_pages / 2, (intmax_t) (SSIZE_MAX / pagesize)) * pagesize;
    fprintf(stderr, "memtrail: limiting to %zi bytes\n", limit_size);
+
+   queue_enabled = !scan_enabled && !residency_enabled && !use_mmap &&
+                   !auto_snapshot && !rolling &&
+                   !numIncludeModules && !numExcludeModules;
+   logged_counter.setScalable(queue_enabled);
 }
 
 
@@ -1136,12 +3969,59 @@ on_exit(void)
 {
    pthread_mutex_lock(&mutex);
    _flush();
-   size_t current_max_size = max_size;
-   size_t current_total_size = total_size;
+   if (residency_enabled) {
+      _sample_residency();
+   }
+   if (scan_enabled) {
+      _open();
+      _scan();
+   }
+   ssize_t current_total_size;
+   ssize_t current_max_size;
+   logged_counter.get(&current_total_size, &current_max_size);
+
+   uint64_t overhead[NUM_STATS];
+   _get_stats(overhead);
+   if (fd >= 0) {
+      PipeBuf buf(fd);
+      buf.write_special(EVENT_STATS);
+      buf.write_varint(NUM_STATS);
+      for (unsigned i = 0; i < NUM_STATS; ++i) {
+         buf.write_varint(overhead[i]);
+      }
+   }
+   if (use_mmap && fd >= 0) {
+      // Later destructors may still log, and map the file again
+      _mmap_trim();
+   }
    pthread_mutex_unlock(&mutex);
 
+   ssize_t current_excluded_size;
+   ssize_t current_max_excluded_size;
+   excluded_counter.get(&current_excluded_size, &current_max_excluded_size);
+
    fprintf(stderr, "memtrail: maximum %zi bytes\n", current_max_size);
    fprintf(stderr, "memtrail: leaked %zi bytes\n", current_total_size);
+   if (current_max_excluded_size) {
+      fprintf(stderr, "memtrail: excluded maximum %zi bytes, leaked %zi bytes\n", current_max_excluded_size, current_excluded_size);
+   }
+
+   fprintf(stderr, "memtrail: overhead: %llu events, %llu frames unwound in %.1f ms\n",
+           (unsigned long long)overhead[STAT_EVENTS],
+           (unsigned long long)overhead[STAT_FRAMES],
+           overhead[STAT_UNWIND_NS] * 1e-6);
+   fprintf(stderr, "memtrail: overhead: symbol cache %.1f%% hits, %llu misses in %.1f ms\n",
+           overhead[STAT_SYMBOL_LOOKUPS] ? 100.0 - 100.0 * overhead[STAT_SYMBOL_MISSES] / overhead[STAT_SYMBOL_LOOKUPS] : 100.0,
+           (unsigned long long)overhead[STAT_SYMBOL_MISSES],
+           overhead[STAT_SYMBOL_MISS_NS] * 1e-6);
+   fprintf(stderr, "memtrail: overhead: %llu flushes in %.1f ms, %llu bytes written in %.1f ms\n",
+           (unsigned long long)overhead[STAT_FLUSHES],
+           overhead[STAT_FLUSH_NS] * 1e-6,
+           (unsigned long long)overhead[STAT_BYTES_WRITTEN],
+           overhead[STAT_WRITE_NS] * 1e-6);
+   fprintf(stderr, "memtrail: overhead: %llu lock waits in %.1f ms\n",
+           (unsigned long long)overhead[STAT_LOCK_WAITS],
+           overhead[STAT_LOCK_WAIT_NS] * 1e-6);
 
    // We don't close the fd here, just in case another destructor that deals
    // with memory gets called after us.
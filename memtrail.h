@@ -28,6 +28,9 @@
 #define _MEMTRAIL_H_
 
 
+#include <stddef.h>
+
+
 #ifdef __linux__
 
 
@@ -55,6 +58,146 @@ _memtrail_snapshot_init(void) {
 }
 
 
+/*
+ * Start/stop tracing allocations, e.g., to only trace a request batch, or to
+ * skip a warm-up phase.  While stopped, allocations are neither unwound nor
+ * logged, so they have next to no overhead.
+ */
+
+static void
+_memtrail_start_init(void);
+
+typedef void (*_memtrail_start_ptr)(void);
+
+static _memtrail_start_ptr
+memtrail_start = &_memtrail_start_init;
+
+static void
+_memtrail_start_noop(void) {
+}
+
+static inline void
+_memtrail_start_init(void) {
+   _memtrail_start_ptr fn = (_memtrail_start_ptr)(uintptr_t)dlsym(RTLD_DEFAULT, "memtrail_start");
+   memtrail_start = fn ? fn : &_memtrail_start_noop;
+   memtrail_start();
+}
+
+
+static void
+_memtrail_stop_init(void);
+
+typedef void (*_memtrail_stop_ptr)(void);
+
+static _memtrail_stop_ptr
+memtrail_stop = &_memtrail_stop_init;
+
+static void
+_memtrail_stop_noop(void) {
+}
+
+static inline void
+_memtrail_stop_init(void) {
+   _memtrail_stop_ptr fn = (_memtrail_stop_ptr)(uintptr_t)dlsym(RTLD_DEFAULT, "memtrail_stop");
+   memtrail_stop = fn ? fn : &_memtrail_stop_noop;
+   memtrail_stop();
+}
+
+
+/*
+ * Report allocations from application-level (pool, arena, etc) allocators, so
+ * that memtrail tracks the individual objects carved out of larger blocks.
+ */
+
+static void
+_memtrail_alloc_event_init(const void *ptr, size_t size);
+
+typedef void (*_memtrail_alloc_event_ptr)(const void *ptr, size_t size);
+
+static _memtrail_alloc_event_ptr
+memtrail_alloc_event = &_memtrail_alloc_event_init;
+
+static void
+_memtrail_alloc_event_noop(const void *ptr, size_t size) {
+   (void)ptr;
+   (void)size;
+}
+
+static inline void
+_memtrail_alloc_event_init(const void *ptr, size_t size) {
+   _memtrail_alloc_event_ptr fn = (_memtrail_alloc_event_ptr)(uintptr_t)dlsym(RTLD_DEFAULT, "memtrail_alloc_event");
+   memtrail_alloc_event = fn ? fn : &_memtrail_alloc_event_noop;
+   memtrail_alloc_event(ptr, size);
+}
+
+
+static void
+_memtrail_free_event_init(const void *ptr);
+
+typedef void (*_memtrail_free_event_ptr)(const void *ptr);
+
+static _memtrail_free_event_ptr
+memtrail_free_event = &_memtrail_free_event_init;
+
+static void
+_memtrail_free_event_noop(const void *ptr) {
+   (void)ptr;
+}
+
+static inline void
+_memtrail_free_event_init(const void *ptr) {
+   _memtrail_free_event_ptr fn = (_memtrail_free_event_ptr)(uintptr_t)dlsym(RTLD_DEFAULT, "memtrail_free_event");
+   memtrail_free_event = fn ? fn : &_memtrail_free_event_noop;
+   memtrail_free_event(ptr);
+}
+
+
+/*
+ * Attribute allocations to a subsystem or request type, by tagging all
+ * allocations done by the current thread until the matching pop.
+ */
+
+static void
+_memtrail_tag_push_init(const char *name);
+
+typedef void (*_memtrail_tag_push_ptr)(const char *name);
+
+static _memtrail_tag_push_ptr
+memtrail_tag_push = &_memtrail_tag_push_init;
+
+static void
+_memtrail_tag_push_noop(const char *name) {
+   (void)name;
+}
+
+static inline void
+_memtrail_tag_push_init(const char *name) {
+   _memtrail_tag_push_ptr fn = (_memtrail_tag_push_ptr)(uintptr_t)dlsym(RTLD_DEFAULT, "memtrail_tag_push");
+   memtrail_tag_push = fn ? fn : &_memtrail_tag_push_noop;
+   memtrail_tag_push(name);
+}
+
+
+static void
+_memtrail_tag_pop_init(void);
+
+typedef void (*_memtrail_tag_pop_ptr)(void);
+
+static _memtrail_tag_pop_ptr
+memtrail_tag_pop = &_memtrail_tag_pop_init;
+
+static void
+_memtrail_tag_pop_noop(void) {
+}
+
+static inline void
+_memtrail_tag_pop_init(void) {
+   _memtrail_tag_pop_ptr fn = (_memtrail_tag_pop_ptr)(uintptr_t)dlsym(RTLD_DEFAULT, "memtrail_tag_pop");
+   memtrail_tag_pop = fn ? fn : &_memtrail_tag_pop_noop;
+   memtrail_tag_pop();
+}
+
+
 #else /* !__linux__ */
 
 
@@ -62,8 +205,61 @@ static void
 memtrail_snapshot(void) {
 }
 
+static void
+memtrail_start(void) {
+}
+
+static void
+memtrail_stop(void) {
+}
+
+static void
+memtrail_alloc_event(const void *ptr, size_t size) {
+   (void)ptr;
+   (void)size;
+}
+
+static void
+memtrail_free_event(const void *ptr) {
+   (void)ptr;
+}
+
+static void
+memtrail_tag_push(const char *name) {
+   (void)name;
+}
+
+static void
+memtrail_tag_pop(void) {
+}
+
 
 #endif /* !__linux__ */
 
 
+#ifdef __cplusplus
+
+/**
+ * Tag all allocations done by the current thread for the lifetime of this
+ * object.
+ */
+class MemtrailTag
+{
+public:
+   MemtrailTag(const char *name) {
+      memtrail_tag_push(name);
+   }
+
+   ~MemtrailTag() {
+      memtrail_tag_pop();
+   }
+
+private:
+   MemtrailTag(const MemtrailTag &);
+   MemtrailTag &operator = (const MemtrailTag &);
+};
+
+#endif /* __cplusplus */
+
+
 #endif /* _MEMTRAIL_H_ */
@@ -0,0 +1,440 @@
+/**************************************************************************
+ *
+ * Copyright 2014 Jose Fonseca
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ **************************************************************************/
+
+
+/*
+ * Measure the overhead libmemtrail adds to the application.
+ *
+ * When invoked without arguments, it runs every benchmark case twice in a
+ * child process -- once natively, and once with libmemtrail preloaded -- and
+ * writes the results as JSON to stdout.  When invoked with --run, it runs a
+ * single case and writes the ns/op to stdout.
+ */
+
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <new>
+
+#include "memtrail.h"
+
+
+static unsigned long iterations = 20000;
+
+
+enum Kind {
+   KIND_MALLOC,
+   KIND_CALLOC,
+   KIND_REALLOC,
+   KIND_ALIGNED_ALLOC,
+   KIND_NEW,
+   KIND_NEW_ARRAY,
+   KIND_NEW_ALIGNED,
+};
+
+static const char *kindNames[] = {
+   "malloc",
+   "calloc",
+   "realloc",
+   "aligned_alloc",
+   "new",
+   "new[]",
+   "new_aligned",
+};
+
+#define NUM_KINDS (sizeof kindNames / sizeof kindNames[0])
+
+
+static const size_t sizes[] = {
+   16,          // small
+   512,         // medium
+   4096,        // page
+   1024*1024,   // large
+};
+
+#define NUM_SIZES (sizeof sizes / sizeof sizes[0])
+
+
+#define DEEP_STACK 32
+
+
+struct Case {
+   unsigned kind;
+   size_t size;
+   unsigned threads;
+   unsigned depth;
+
+   // Record only tags (MEMTRAIL_TAGS_ONLY), with every allocation tagged
+   unsigned tags;
+};
+
+
+/**
+ * Prevent the compiler from eliding allocation/free pairs.
+ */
+static inline void
+escape(void *p)
+{
+   asm volatile ("" : : "r" (p) : "memory");
+}
+
+
+static __attribute__ ((noinline)) void
+alloc_free(const Case *c)
+{
+   void *p;
+
+   switch (c->kind) {
+   case KIND_MALLOC:
+      p = malloc(c->size);
+      escape(p);
+      free(p);
+      break;
+   case KIND_CALLOC:
+      p = calloc(1, c->size);
+      escape(p);
+      free(p);
+      break;
+   case KIND_REALLOC:
+      p = malloc(c->size / 2);
+      escape(p);
+      p = realloc(p, c->size);
+      escape(p);
+      free(p);
+      break;
+   case KIND_ALIGNED_ALLOC:
+      p = aligned_alloc(4096, c->size);
+      escape(p);
+      free(p);
+      break;
+   case KIND_NEW:
+      p = operator new(c->size);
+      escape(p);
+      operator delete(p);
+      break;
+   case KIND_NEW_ARRAY:
+      p = operator new[](c->size);
+      escape(p);
+      operator delete[](p);
+      break;
+   case KIND_NEW_ALIGNED:
+      p = operator new(c->size, std::align_val_t(64));
+      escape(p);
+      operator delete(p, std::align_val_t(64));
+      break;
+   default:
+      assert(0);
+   }
+}
+
+
+static __attribute__ ((noinline)) void
+recurse(const Case *c, unsigned depth)
+{
+   if (depth) {
+      recurse(c, depth - 1);
+   } else {
+      alloc_free(c);
+   }
+
+   // Prevent tail call optimization
+   asm volatile ("" : : : "memory");
+}
+
+
+static inline double
+now(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+static pthread_barrier_t barrier;
+
+
+struct Thread {
+   pthread_t thread;
+   const Case *c;
+   double elapsed;
+};
+
+
+static void *
+thread_func(void *arg)
+{
+   Thread *t = (Thread *)arg;
+   const Case *c = t->c;
+
+   pthread_barrier_wait(&barrier);
+
+   double start = now();
+   if (c->tags) {
+      for (unsigned long i = 0; i < iterations; ++i) {
+         memtrail_tag_push("overhead");
+         recurse(c, c->depth);
+         memtrail_tag_pop();
+      }
+   } else {
+      for (unsigned long i = 0; i < iterations; ++i) {
+         recurse(c, c->depth);
+      }
+   }
+   t->elapsed = now() - start;
+
+   return NULL;
+}
+
+
+/**
+ * Run a single case, returning the average time per allocation/free pair,
+ * as seen by each thread.
+ */
+static double
+run(const Case *c)
+{
+   Thread threads[c->threads];
+
+   pthread_barrier_init(&barrier, NULL, c->threads);
+
+   for (unsigned t = 0; t < c->threads; ++t) {
+      threads[t].c = c;
+      pthread_create(&threads[t].thread, NULL, thread_func, &threads[t]);
+   }
+
+   double elapsed = 0;
+   for (unsigned t = 0; t < c->threads; ++t) {
+      pthread_join(threads[t].thread, NULL);
+      elapsed += threads[t].elapsed;
+   }
+
+   pthread_barrier_destroy(&barrier);
+
+   return elapsed / (c->threads * iterations);
+}
+
+
+/**
+ * Run a single case in a child process, returning its ns/op, and optionally
+ * the uncompressed size of the trace it produced.
+ */
+static double
+spawn(const Case *c, const char *preload, const char *dir, double *trace_size)
+{
+   int fds[2];
+   if (pipe(fds) != 0) {
+      perror("pipe");
+      exit(1);
+   }
+
+   pid_t pid = fork();
+   if (pid < 0) {
+      perror("fork");
+      exit(1);
+   }
+
+   if (pid == 0) {
+      close(fds[0]);
+      dup2(fds[1], STDOUT_FILENO);
+
+      if (chdir(dir) != 0) {
+         _exit(1);
+      }
+
+      // Silence memtrail's own messages
+      int devnull = open("/dev/null", O_WRONLY);
+      if (devnull >= 0) {
+         dup2(devnull, STDERR_FILENO);
+         close(devnull);
+      }
+
+      if (preload) {
+         setenv("LD_PRELOAD", preload, 1);
+      } else {
+         unsetenv("LD_PRELOAD");
+      }
+
+      if (c->tags) {
+         setenv("MEMTRAIL_TAGS_ONLY", "1", 1);
+      } else {
+         unsetenv("MEMTRAIL_TAGS_ONLY");
+      }
+
+      char kind[16], size[32], threads[16], depth[16], tags[16], iters[32];
+      snprintf(kind, sizeof kind, "%u", c->kind);
+      snprintf(size, sizeof size, "%zu", c->size);
+      snprintf(threads, sizeof threads, "%u", c->threads);
+      snprintf(depth, sizeof depth, "%u", c->depth);
+      snprintf(tags, sizeof tags, "%u", c->tags);
+      snprintf(iters, sizeof iters, "%lu", iterations);
+
+      execl("/proc/self/exe", "overhead", "--run", kind, size, threads, depth, tags, iters, NULL);
+      _exit(1);
+   }
+
+   close(fds[1]);
+
+   double ns_per_op = 0;
+   FILE *fp = fdopen(fds[0], "r");
+   if (fscanf(fp, "%lf", &ns_per_op) != 1) {
+      ns_per_op = 0;
+   }
+   fclose(fp);
+
+   int status;
+   waitpid(pid, &status, 0);
+   if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      fprintf(stderr, "overhead: error: %s case failed\n", kindNames[c->kind]);
+      exit(1);
+   }
+
+   if (trace_size) {
+      char cmd[PATH_MAX + 64];
+
+      // The gzip process outlives the application, so wait for it to finish
+      snprintf(cmd, sizeof cmd, "gzip -t %s/memtrail.data 2> /dev/null", dir);
+      for (unsigned retries = 0; system(cmd) != 0 && retries < 500; ++retries) {
+         usleep(10000);
+      }
+
+      snprintf(cmd, sizeof cmd, "gzip -dc %s/memtrail.data | wc -c", dir);
+      *trace_size = 0;
+      FILE *wc = popen(cmd, "r");
+      if (wc) {
+         if (fscanf(wc, "%lf", trace_size) != 1) {
+            *trace_size = 0;
+         }
+         pclose(wc);
+      }
+   }
+
+   return ns_per_op;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+   if (argc == 8 && strcmp(argv[1], "--run") == 0) {
+      Case c;
+      c.kind = atoi(argv[2]);
+      c.size = atol(argv[3]);
+      c.threads = atoi(argv[4]);
+      c.depth = atoi(argv[5]);
+      c.tags = atoi(argv[6]);
+      iterations = atol(argv[7]);
+      if (c.kind >= NUM_KINDS || !c.threads) {
+         return 1;
+      }
+      printf("%f\n", run(&c));
+      return 0;
+   }
+
+   const char *preload = "./libmemtrail.so";
+   unsigned max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+   for (int i = 1; i < argc; ++i) {
+      if (strcmp(argv[i], "--preload") == 0 && i + 1 < argc) {
+         preload = argv[++i];
+      } else if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) {
+         iterations = atol(argv[++i]);
+      } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+         max_threads = atoi(argv[++i]);
+      } else {
+         fprintf(stderr, "usage: %s [--preload libmemtrail.so] [--iterations N] [--threads N]\n", argv[0]);
+         return 1;
+      }
+   }
+
+   char abs_preload[PATH_MAX];
+   if (!realpath(preload, abs_preload)) {
+      fprintf(stderr, "overhead: error: %s not found\n", preload);
+      return 1;
+   }
+
+   char dir[] = "/tmp/memtrail-overhead-XXXXXX";
+   if (!mkdtemp(dir)) {
+      perror("mkdtemp");
+      return 1;
+   }
+
+   // Every kind and size on a single thread, then thread scaling, stack
+   // depth, and tags only on small mallocs
+   Case cases[NUM_KINDS * NUM_SIZES + 64];
+   unsigned num_cases = 0;
+   for (unsigned k = 0; k < NUM_KINDS; ++k) {
+      for (unsigned s = 0; s < NUM_SIZES; ++s) {
+         cases[num_cases++] = Case{k, sizes[s], 1, 0, 0};
+      }
+   }
+   for (unsigned t = 2; t <= max_threads && num_cases < sizeof cases / sizeof cases[0] - 2; t *= 2) {
+      cases[num_cases++] = Case{KIND_MALLOC, sizes[0], t, 0, 0};
+   }
+   cases[num_cases++] = Case{KIND_MALLOC, sizes[0], 1, DEEP_STACK, 0};
+   cases[num_cases++] = Case{KIND_MALLOC, sizes[0], 1, 0, 1};
+
+   printf("[\n");
+   for (unsigned i = 0; i < num_cases; ++i) {
+      const Case *c = &cases[i];
+
+      double trace_size;
+      double native = spawn(c, NULL, dir, NULL);
+      double traced = spawn(c, abs_preload, dir, &trace_size);
+
+      // Each iteration yields one allocation and one free event per thread
+      double events = 2.0 * iterations * c->threads;
+
+      printf("  {\"kind\": \"%s\", \"size\": %zu, \"threads\": %u, \"depth\": %u, \"tags_only\": %s, \"iterations\": %lu, "
+             "\"native_ns_per_op\": %.1f, \"memtrail_ns_per_op\": %.1f, \"trace_bytes_per_event\": %.1f}%s\n",
+             kindNames[c->kind], c->size, c->threads, c->depth, c->tags ? "true" : "false", iterations,
+             native, traced, trace_size / events,
+             i + 1 < num_cases ? "," : "");
+      fflush(stdout);
+   }
+   printf("]\n");
+
+   char cmd[PATH_MAX + 16];
+   snprintf(cmd, sizeof cmd, "rm -rf %s", dir);
+   if (system(cmd) != 0) {
+      fprintf(stderr, "overhead: warning: could not remove %s\n", dir);
+   }
+
+   return 0;
+}
+
+
+// vim:set sw=3 ts=3 et:
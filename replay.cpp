@@ -0,0 +1,240 @@
+/**************************************************************************
+ *
+ * Copyright 2014 Jose Fonseca
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ **************************************************************************/
+
+
+/*
+ * Replay the allocations of a recorded trace against the allocator in use.
+ *
+ * The trace is first converted by `memtrail replay` into a flat sequence of
+ * operations, each a slot number and a signed size -- positive to allocate
+ * the slot, negative to free it -- preceded by the number of slots.  This
+ * program then replays them, touching every page of each allocation as the
+ * application would, and writes the wall time and resident set size as JSON
+ * to stdout.
+ *
+ * The allocator is whatever malloc/free resolve to, so it can be swapped with
+ * LD_PRELOAD, or alternatively loaded with --dlopen.
+ */
+
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+struct Op {
+   uint64_t slot;
+   int64_t size;
+};
+
+
+typedef void *(*malloc_t)(size_t size);
+typedef void (*free_t)(void *ptr);
+
+
+static inline double
+now(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+/**
+ * Read a field, in bytes, from /proc/self/status.
+ */
+static size_t
+status(const char *name)
+{
+   FILE *fp = fopen("/proc/self/status", "rt");
+   if (!fp) {
+      return 0;
+   }
+
+   size_t len = strlen(name);
+   size_t value = 0;
+   char line[256];
+   while (fgets(line, sizeof line, fp)) {
+      if (strncmp(line, name, len) == 0 && line[len] == ':') {
+         value = strtoul(line + len + 1, NULL, 10) * 1024;
+         break;
+      }
+   }
+
+   fclose(fp);
+   return value;
+}
+
+
+/**
+ * Reset the peak resident set size, so it only covers the replay.
+ */
+static void
+reset_peak(void)
+{
+   int fd = open("/proc/self/clear_refs", O_WRONLY);
+   if (fd >= 0) {
+      if (write(fd, "5", 1) != 1) {
+         fprintf(stderr, "replay: warning: could not reset peak RSS\n");
+      }
+      close(fd);
+   }
+}
+
+
+int
+main(int argc, char *argv[])
+{
+   const char *library = NULL;
+   const char *filename = NULL;
+
+   for (int i = 1; i < argc; ++i) {
+      if (strcmp(argv[i], "--dlopen") == 0 && i + 1 < argc) {
+         library = argv[++i];
+      } else if (!filename && argv[i][0] != '-') {
+         filename = argv[i];
+      } else {
+         filename = NULL;
+         break;
+      }
+   }
+
+   if (!filename) {
+      fprintf(stderr, "usage: %s [--dlopen liballocator.so] memtrail.replay\n", argv[0]);
+      return 1;
+   }
+
+   malloc_t malloc_fn = malloc;
+   free_t free_fn = free;
+   if (library) {
+      void *handle = dlopen(library, RTLD_NOW | RTLD_LOCAL);
+      if (!handle) {
+         fprintf(stderr, "replay: error: %s\n", dlerror());
+         return 1;
+      }
+      malloc_fn = (malloc_t)dlsym(handle, "malloc");
+      free_fn = (free_t)dlsym(handle, "free");
+      if (!malloc_fn || !free_fn) {
+         fprintf(stderr, "replay: error: %s does not export malloc/free\n", library);
+         return 1;
+      }
+   }
+
+   // Map everything up front, outside the allocator under test, so that it
+   // is all resident before the baseline is taken
+   int fd = open(filename, O_RDONLY);
+   if (fd < 0) {
+      perror(filename);
+      return 1;
+   }
+   struct stat st;
+   if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(uint64_t)) {
+      fprintf(stderr, "replay: error: %s is truncated\n", filename);
+      return 1;
+   }
+   const uint8_t *data = (const uint8_t *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+   if (data == MAP_FAILED) {
+      perror("mmap");
+      return 1;
+   }
+   close(fd);
+
+   uint64_t numSlots;
+   memcpy(&numSlots, data, sizeof numSlots);
+   const Op *ops = (const Op *)(data + sizeof numSlots);
+   size_t numOps = (st.st_size - sizeof numSlots) / sizeof *ops;
+
+   size_t slotsSize = numSlots * sizeof(void *) + 1;
+   void **slots = (void **)mmap(NULL, slotsSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+   if (slots == MAP_FAILED) {
+      perror("mmap");
+      return 1;
+   }
+
+   long pageSize = sysconf(_SC_PAGESIZE);
+
+   reset_peak();
+   size_t baseline = status("VmRSS");
+
+   int64_t total_size = 0;
+   int64_t max_size = 0;
+
+   double start = now();
+   for (size_t i = 0; i < numOps; ++i) {
+      const Op *op = &ops[i];
+      if (op->slot >= numSlots) {
+         fprintf(stderr, "replay: error: slot %llu out of range\n", (unsigned long long)op->slot);
+         return 1;
+      }
+
+      if (op->size > 0) {
+         size_t size = op->size;
+         char *p = (char *)malloc_fn(size);
+         if (!p) {
+            fprintf(stderr, "replay: error: out of memory\n");
+            return 1;
+         }
+         for (size_t offset = 0; offset < size; offset += pageSize) {
+            p[offset] = 0;
+         }
+         slots[op->slot] = p;
+
+         total_size += op->size;
+         if (total_size > max_size) {
+            max_size = total_size;
+         }
+      } else {
+         free_fn(slots[op->slot]);
+         slots[op->slot] = NULL;
+
+         total_size += op->size;
+      }
+   }
+   double elapsed = now() - start;
+
+   size_t peak = status("VmHWM");
+   size_t final = status("VmRSS");
+   size_t peak_rss = peak > baseline ? peak - baseline : 0;
+   size_t final_rss = final > baseline ? final - baseline : 0;
+
+   printf("{\"ops\": %zu, \"wall_ns\": %.0f, \"max_size\": %lld, \"leaked_size\": %lld, "
+          "\"peak_rss\": %zu, \"final_rss\": %zu, \"fragmentation\": %.3f}\n",
+          numOps, elapsed, (long long)max_size, (long long)total_size,
+          peak_rss, final_rss, max_size ? (double)peak_rss / max_size : 0.0);
+
+   return 0;
+}
+
+
+// vim:set sw=3 ts=3 et:
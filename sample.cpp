@@ -118,6 +118,12 @@ test_realloc(void)
    assert(p);
    p = realloc(p, 0);
    assert(!p);
+
+   // grow by doubling
+   for (size_t size = 16; size <= 1024; size *= 2) {
+      p = realloc(p, size);
+   }
+   free(p);
 }
 
 
@@ -398,6 +404,67 @@ test_subprocess(void)
 }
 
 
+static void
+test_custom(void)
+{
+   char *pool = (char *)malloc(4096);
+   memset(pool, 0, 4096);
+
+   // allocate some
+   memtrail_alloc_event(pool, 64);
+
+   // leak some
+   memtrail_alloc_event(pool + 64, 128);
+   leaked += 128;
+
+   // free some
+   memtrail_free_event(pool);
+
+   free(pool);
+}
+
+
+static void
+test_tags(void)
+{
+   MemtrailTag tag("tags");
+
+   // leak some
+   malloc(16);
+   leaked += 16;
+
+   memtrail_tag_push("nested");
+   malloc(8);
+   leaked += 8;
+   memtrail_tag_pop();
+}
+
+
+static void
+test_start_stop(void)
+{
+   void *traced = malloc(512);
+
+   memtrail_stop();
+
+   // not traced, so not a leak as far as memtrail is concerned
+   malloc(1024);
+
+   void *untraced = malloc(2048);
+   void *resized = realloc(malloc(16), 32);
+
+   // traced, but freed while stopped
+   free(traced);
+
+   memtrail_start();
+
+   // untraced, but freed or resized while started
+   free(untraced);
+   resized = realloc(resized, 64);
+   free(resized);
+}
+
+
 static void
 test_snapshot(void)
 {
@@ -461,6 +528,9 @@ main(int argc, char *argv[])
    test_strndup();
    test_vasprintf();
    test_subprocess();
+   test_custom();
+   test_tags();
+   test_start_stop();
    test_snapshot();
 
    atexit(test_atexit);